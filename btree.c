@@ -0,0 +1,372 @@
+/*
+ * B+ tree of payload ranges, keyed by low address
+ *
+ * Each node is a few cache lines holding up to 32 ranges (leaves) or
+ * 32 children (inner nodes), and is searched by a linear scan.  Inner
+ * node key[j] is a lower bound on the keys in child[j + 1] and an
+ * upper bound on the keys in child[j].  Nodes are carved out of large
+ * pools and recycled through a free list, so inserting and removing
+ * ranges costs no calls to malloc in the steady state.
+ *
+ * Deletion does not rebalance: a node that becomes empty is unlinked,
+ * and a root with one child is collapsed, which keeps every leaf but
+ * an empty root non-empty.  The height never exceeds that of the
+ * largest set of ranges the tree has held.
+ */
+
+#include <string.h>
+
+#include "btree.h"
+
+#define LEAF_SLOTS 32  /* ranges per leaf */
+#define INNER_SLOTS 32 /* children per inner node */
+#define POOL_NODES 256 /* nodes allocated at a time */
+
+struct bnode
+{
+    bool leaf;
+    int count; /* number of ranges in a leaf, children in an inner node */
+    union
+    {
+        struct
+        {
+            range_t r[LEAF_SLOTS];
+            bnode_t *prev, *next; /* neighbors in the leaf chain */
+        } l;
+        struct
+        {
+            uintptr_t key[INNER_SLOTS - 1];
+            bnode_t *child[INNER_SLOTS];
+        } i;
+    } u;
+};
+
+struct bpool
+{
+    bpool_t *next;
+    bnode_t nodes[POOL_NODES];
+};
+
+static bnode_t *node_alloc(btree_t *tree, bool leaf);
+static void node_free(btree_t *tree, bnode_t *n);
+static bool insert_rec(btree_t *tree, bnode_t *n, const range_t *r,
+                       uintptr_t *up_key, bnode_t **up_node);
+static int remove_rec(btree_t *tree, bnode_t *n, uintptr_t key);
+
+/* Index of the first range in leaf n with lo > key */
+static inline int leaf_upper(const bnode_t *n, uintptr_t key)
+{
+    int s = 0;
+    while (s < n->count && (uintptr_t)n->u.l.r[s].lo <= key)
+        s++;
+    return s;
+}
+
+/* Index of the child of inner node n whose keys cover key */
+static inline int inner_child(const bnode_t *n, uintptr_t key)
+{
+    int c = 0;
+    while (c < n->count - 1 && n->u.i.key[c] <= key)
+        c++;
+    return c;
+}
+
+btree_t *btree_new(void)
+{
+    btree_t *tree = malloc(sizeof(btree_t));
+    if (!tree)
+    {
+        fprintf(stderr, "ERROR.  Couldn't create range tree\n");
+        exit(1);
+    }
+    tree->free_nodes = NULL;
+    tree->pools = NULL;
+    tree->root = tree->first = node_alloc(tree, true);
+    tree->count = 0;
+    tree->height = 1;
+    return tree;
+}
+
+void btree_free(btree_t *tree)
+{
+    bpool_t *p, *next;
+    for (p = tree->pools; p; p = next)
+    {
+        next = p->next;
+        free(p);
+    }
+    free(tree);
+}
+
+bool btree_insert(btree_t *tree, const range_t *r)
+{
+    uintptr_t up_key;
+    bnode_t *up_node = NULL;
+
+    if (!insert_rec(tree, tree->root, r, &up_key, &up_node))
+        /* Already have key in tree */
+        return false;
+    if (up_node)
+    {
+        /* The root split, so grow a new one above it */
+        bnode_t *root = node_alloc(tree, false);
+        root->count = 2;
+        root->u.i.child[0] = tree->root;
+        root->u.i.child[1] = up_node;
+        root->u.i.key[0] = up_key;
+        tree->root = root;
+        tree->height++;
+    }
+    tree->count++;
+    return true;
+}
+
+void btree_find_nearest(btree_t *tree, const char *key, range_t **prev,
+                        range_t **next)
+{
+    uintptr_t k = (uintptr_t)key;
+    bnode_t *n = tree->root;
+    int s;
+
+    while (!n->leaf)
+        n = n->u.i.child[inner_child(n, k)];
+    s = leaf_upper(n, k);
+
+    /* Neighbors outside this leaf are at the ends of the adjacent ones */
+    if (s > 0)
+        *prev = &n->u.l.r[s - 1];
+    else if (n->u.l.prev)
+        *prev = &n->u.l.prev->u.l.r[n->u.l.prev->count - 1];
+    else
+        *prev = NULL;
+    if (s < n->count)
+        *next = &n->u.l.r[s];
+    else if (n->u.l.next)
+        *next = &n->u.l.next->u.l.r[0];
+    else
+        *next = NULL;
+}
+
+bool btree_remove(btree_t *tree, const char *key)
+{
+    bnode_t *root;
+    int res = remove_rec(tree, tree->root, (uintptr_t)key);
+
+    if (res < 0)
+        return false;
+    tree->count--;
+    if (res > 0 && !tree->root->leaf)
+    {
+        /* Every leaf is gone; start over with an empty one */
+        node_free(tree, tree->root);
+        tree->root = tree->first = node_alloc(tree, true);
+        tree->height = 1;
+    }
+    while (!tree->root->leaf && tree->root->count == 1)
+    {
+        root = tree->root;
+        tree->root = root->u.i.child[0];
+        tree->height--;
+        node_free(tree, root);
+    }
+    return true;
+}
+
+range_t *btree_first(btree_t *tree, biter_t *it)
+{
+    it->leaf = tree->first;
+    it->slot = 0;
+    return it->leaf->count > 0 ? &it->leaf->u.l.r[0] : NULL;
+}
+
+range_t *btree_next(biter_t *it)
+{
+    if (++it->slot >= it->leaf->count)
+    {
+        it->leaf = it->leaf->u.l.next;
+        it->slot = 0;
+        if (!it->leaf)
+            return NULL;
+    }
+    return &it->leaf->u.l.r[it->slot];
+}
+
+void btree_show(btree_t *tree)
+{
+    biter_t it;
+    range_t *r;
+
+    printf("%zu ranges, height %d\n", tree->count, tree->height);
+    for (r = btree_first(tree, &it); r; r = btree_next(&it))
+        printf("  [%p:%p] index %d\n", r->lo, r->hi, r->index);
+}
+
+/*
+ * node_alloc - Take a node from the free list, refilling it from a
+ *     new pool when it is empty
+ */
+static bnode_t *node_alloc(btree_t *tree, bool leaf)
+{
+    bnode_t *n;
+    int j;
+
+    if (!tree->free_nodes)
+    {
+        bpool_t *p = malloc(sizeof(bpool_t));
+        if (!p)
+        {
+            fprintf(stderr, "ERROR.  Couldn't create range tree node\n");
+            exit(1);
+        }
+        p->next = tree->pools;
+        tree->pools = p;
+        for (j = POOL_NODES - 1; j >= 0; j--)
+            node_free(tree, &p->nodes[j]);
+    }
+    n = tree->free_nodes;
+    tree->free_nodes = n->u.l.next;
+    n->leaf = leaf;
+    n->count = 0;
+    n->u.l.prev = n->u.l.next = NULL;
+    return n;
+}
+
+static void node_free(btree_t *tree, bnode_t *n)
+{
+    n->u.l.next = tree->free_nodes;
+    tree->free_nodes = n;
+}
+
+/* Insert key and child into inner node n at key position pos */
+static void inner_insert(bnode_t *n, int pos, uintptr_t key, bnode_t *child)
+{
+    memmove(&n->u.i.key[pos + 1], &n->u.i.key[pos],
+            (n->count - 1 - pos) * sizeof(uintptr_t));
+    memmove(&n->u.i.child[pos + 2], &n->u.i.child[pos + 1],
+            (n->count - 1 - pos) * sizeof(bnode_t *));
+    n->u.i.key[pos] = key;
+    n->u.i.child[pos + 1] = child;
+    n->count++;
+}
+
+/*
+ * insert_rec - Insert r into the subtree rooted at n.  If n had to be
+ *     split, the new right sibling and its lower bound are returned
+ *     in up_node and up_key.
+ */
+static bool insert_rec(btree_t *tree, bnode_t *n, const range_t *r,
+                       uintptr_t *up_key, bnode_t **up_node)
+{
+    uintptr_t k = (uintptr_t)r->lo;
+    uintptr_t child_key;
+    bnode_t *m, *child_node = NULL;
+    int s, c, half;
+
+    if (n->leaf)
+    {
+        s = leaf_upper(n, k);
+        if (s > 0 && (uintptr_t)n->u.l.r[s - 1].lo == k)
+            return false;
+        if (n->count == LEAF_SLOTS)
+        {
+            /* Move the upper half to a new leaf after this one */
+            half = LEAF_SLOTS / 2;
+            m = node_alloc(tree, true);
+            memcpy(m->u.l.r, &n->u.l.r[half],
+                   (LEAF_SLOTS - half) * sizeof(range_t));
+            m->count = LEAF_SLOTS - half;
+            n->count = half;
+            m->u.l.prev = n;
+            m->u.l.next = n->u.l.next;
+            if (n->u.l.next)
+                n->u.l.next->u.l.prev = m;
+            n->u.l.next = m;
+            *up_key = (uintptr_t)m->u.l.r[0].lo;
+            *up_node = m;
+            if (s > half)
+            {
+                n = m;
+                s -= half;
+            }
+        }
+        memmove(&n->u.l.r[s + 1], &n->u.l.r[s],
+                (n->count - s) * sizeof(range_t));
+        n->u.l.r[s] = *r;
+        n->count++;
+        return true;
+    }
+
+    c = inner_child(n, k);
+    if (!insert_rec(tree, n->u.i.child[c], r, &child_key, &child_node))
+        return false;
+    if (!child_node)
+        return true;
+    if (n->count == INNER_SLOTS)
+    {
+        /* Move the upper half of the children to a new inner node */
+        half = INNER_SLOTS / 2;
+        m = node_alloc(tree, false);
+        memcpy(m->u.i.child, &n->u.i.child[half],
+               (INNER_SLOTS - half) * sizeof(bnode_t *));
+        memcpy(m->u.i.key, &n->u.i.key[half],
+               (INNER_SLOTS - half - 1) * sizeof(uintptr_t));
+        m->count = INNER_SLOTS - half;
+        n->count = half;
+        *up_key = n->u.i.key[half - 1];
+        *up_node = m;
+        if (c >= half)
+        {
+            n = m;
+            c -= half;
+        }
+    }
+    inner_insert(n, c, child_key, child_node);
+    return true;
+}
+
+/*
+ * remove_rec - Remove the range at key from the subtree rooted at n.
+ *     Returns -1 if there is no such range, 1 if n is now empty, and
+ *     0 otherwise.
+ */
+static int remove_rec(btree_t *tree, bnode_t *n, uintptr_t key)
+{
+    bnode_t *child;
+    int s, c, res;
+
+    if (n->leaf)
+    {
+        s = leaf_upper(n, key);
+        if (s == 0 || (uintptr_t)n->u.l.r[s - 1].lo != key)
+            return -1;
+        memmove(&n->u.l.r[s - 1], &n->u.l.r[s],
+                (n->count - s) * sizeof(range_t));
+        n->count--;
+        return n->count == 0;
+    }
+
+    c = inner_child(n, key);
+    child = n->u.i.child[c];
+    if ((res = remove_rec(tree, child, key)) <= 0)
+        return res;
+
+    /* The child is empty: unlink it and drop it along with one bound */
+    if (child->leaf)
+    {
+        if (child->u.l.prev)
+            child->u.l.prev->u.l.next = child->u.l.next;
+        else
+            tree->first = child->u.l.next;
+        if (child->u.l.next)
+            child->u.l.next->u.l.prev = child->u.l.prev;
+    }
+    node_free(tree, child);
+    s = c > 0 ? c - 1 : 0;
+    if (n->count > 1)
+        memmove(&n->u.i.key[s], &n->u.i.key[s + 1],
+                (n->count - 2 - s) * sizeof(uintptr_t));
+    memmove(&n->u.i.child[c], &n->u.i.child[c + 1],
+            (n->count - 1 - c) * sizeof(bnode_t *));
+    n->count--;
+    return n->count == 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * B+ tree of payload ranges, keyed by low address
+ *
+ * Used by the driver to check for overlapping allocations.  Ranges are
+ * stored inline in the leaves, which are chained in address order, and
+ * all nodes come from a pool owned by the tree.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Records the extent of one block's payload */
+typedef struct {
+    char *lo;  /* low payload address (the key) */
+    char *hi;  /* high payload address */
+    int index; /* same index as free; for debugging */
+} range_t;
+
+typedef struct bnode bnode_t;
+typedef struct bpool bpool_t;
+
+typedef struct {
+    bnode_t *root;
+    bnode_t *first; /* leftmost leaf */
+    size_t count;   /* number of ranges */
+    int height;     /* 1 when the root is a leaf */
+    bnode_t *free_nodes;
+    bpool_t *pools;
+} btree_t;
+
+/* Position of a range in the leaf chain, for walking the tree in order */
+typedef struct {
+    bnode_t *leaf;
+    int slot;
+} biter_t;
+
+btree_t *btree_new(void);
+
+/* Delete the tree and all of its ranges */
+void btree_free(btree_t *tree);
+
+/* Insertion function returns false if already have a range at r->lo */
+bool btree_insert(btree_t *tree, const range_t *r);
+
+/*
+ * Find the range with the largest lo <= key and the range with the
+ * smallest lo > key.  Either may be NULL.
+ */
+void btree_find_nearest(btree_t *tree, const char *key, range_t **prev,
+                        range_t **next);
+
+/* Returns false if there is no range at key */
+bool btree_remove(btree_t *tree, const char *key);
+
+/* Walk the ranges in address order: first, then next until NULL */
+range_t *btree_first(btree_t *tree, biter_t *it);
+range_t *btree_next(biter_t *it);
+
+/* Print ranges in tree */
+void btree_show(btree_t *tree);
@@ -0,0 +1,164 @@
+/*
+ * Cache model for the access profile of the emulated heap
+ *
+ * Each set keeps its tags in recency order, most recent first, so a
+ * lookup is a scan of one set and a hit moves the tag to the front.
+ * Tags are stored plus one, so that zero marks an invalid way.
+ *
+ * A line set is an open-addressed hash table whose entries are stamped
+ * with the generation they were added in; clearing the set just starts
+ * a new generation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachesim.h"
+
+#define LINESET_MIN_SLOTS 1024 /* initial table size, a power of 2 */
+
+struct cache
+{
+    size_t line;     /* line size in bytes */
+    size_t sets;     /* number of sets */
+    int ways;        /* lines per set */
+    uintptr_t *tags; /* sets * ways tags, each set in recency order */
+};
+
+struct lineset
+{
+    uintptr_t *keys;
+    uint32_t *gens; /* generation each slot was filled in */
+    size_t slots;   /* table size, a power of 2 */
+    size_t count;   /* entries in the current generation */
+    uint32_t gen;
+};
+
+static void *must_alloc(size_t bytes)
+{
+    void *p = calloc(1, bytes);
+    if (!p)
+    {
+        fprintf(stderr, "ERROR.  Couldn't create cache model\n");
+        exit(1);
+    }
+    return p;
+}
+
+cache_t *cache_new(size_t bytes, int ways, size_t line)
+{
+    cache_t *c = must_alloc(sizeof(cache_t));
+
+    c->line = line;
+    c->ways = ways;
+    c->sets = bytes / (line * ways);
+    if (c->sets == 0)
+        c->sets = 1;
+    c->tags = must_alloc(c->sets * ways * sizeof(uintptr_t));
+    return c;
+}
+
+void cache_free(cache_t *c)
+{
+    free(c->tags);
+    free(c);
+}
+
+void cache_flush(cache_t *c)
+{
+    memset(c->tags, 0, c->sets * c->ways * sizeof(uintptr_t));
+}
+
+bool cache_access(cache_t *c, uintptr_t addr)
+{
+    uintptr_t n = addr / c->line;
+    uintptr_t *set = &c->tags[(n % c->sets) * c->ways];
+    uintptr_t tag = n + 1;
+    bool hit;
+    int w;
+
+    for (w = 0; w < c->ways && set[w] != tag; w++)
+        ;
+    hit = w < c->ways;
+    /* On a miss, the least recently used way is replaced */
+    if (!hit)
+        w = c->ways - 1;
+    memmove(&set[1], &set[0], w * sizeof(uintptr_t));
+    set[0] = tag;
+    return hit;
+}
+
+lineset_t *lineset_new(void)
+{
+    lineset_t *s = must_alloc(sizeof(lineset_t));
+
+    s->slots = LINESET_MIN_SLOTS;
+    s->keys = must_alloc(s->slots * sizeof(uintptr_t));
+    s->gens = must_alloc(s->slots * sizeof(uint32_t));
+    s->gen = 1;
+    return s;
+}
+
+void lineset_free(lineset_t *s)
+{
+    free(s->keys);
+    free(s->gens);
+    free(s);
+}
+
+void lineset_clear(lineset_t *s)
+{
+    s->count = 0;
+    if (++s->gen == 0)
+    {
+        /* The stamps wrapped around; make every slot stale again */
+        memset(s->gens, 0, s->slots * sizeof(uint32_t));
+        s->gen = 1;
+    }
+}
+
+/* Slot for n: where it is, or the empty slot where it would go */
+static size_t lineset_slot(const lineset_t *s, uintptr_t n)
+{
+    size_t i = (n * 0x9E3779B97F4A7C15UL) & (s->slots - 1);
+
+    while (s->gens[i] == s->gen && s->keys[i] != n)
+        i = (i + 1) & (s->slots - 1);
+    return i;
+}
+
+/* Double the table, keeping the entries of the current generation */
+static void lineset_grow(lineset_t *s)
+{
+    uintptr_t *keys = s->keys;
+    uint32_t *gens = s->gens;
+    size_t i, j, slots = s->slots;
+
+    s->slots *= 2;
+    s->keys = must_alloc(s->slots * sizeof(uintptr_t));
+    s->gens = must_alloc(s->slots * sizeof(uint32_t));
+    for (i = 0; i < slots; i++)
+    {
+        if (gens[i] != s->gen)
+            continue;
+        j = lineset_slot(s, keys[i]);
+        s->keys[j] = keys[i];
+        s->gens[j] = s->gen;
+    }
+    free(keys);
+    free(gens);
+}
+
+bool lineset_add(lineset_t *s, uintptr_t n)
+{
+    size_t i = lineset_slot(s, n);
+
+    if (s->gens[i] == s->gen)
+        return false;
+    s->keys[i] = n;
+    s->gens[i] = s->gen;
+    if (++s->count * 2 > s->slots)
+        lineset_grow(s);
+    return true;
+}
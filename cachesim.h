@@ -0,0 +1,37 @@
+/*
+ * Cache model for the access profile of the emulated heap
+ *
+ * A set-associative cache with LRU replacement, which serves equally
+ * for a TLB when its lines are pages, and a set of line numbers for
+ * counting the distinct lines an operation touches.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct cache cache_t;
+typedef struct lineset lineset_t;
+
+/* Make an empty cache of the given size, associativity and line size */
+cache_t *cache_new(size_t bytes, int ways, size_t line);
+
+/* Delete the cache */
+void cache_free(cache_t *c);
+
+/* Invalidate every line */
+void cache_flush(cache_t *c);
+
+/*
+ * Look up the line holding addr, and make it the most recently used
+ * one in its set, filling it on a miss.  Returns true on a hit.
+ */
+bool cache_access(cache_t *c, uintptr_t addr);
+
+lineset_t *lineset_new(void);
+void lineset_free(lineset_t *s);
+
+/* Empty the set.  Takes constant time */
+void lineset_clear(lineset_t *s);
+
+/* Add line number n to the set.  Returns true if it was not there */
+bool lineset_add(lineset_t *s, uintptr_t n);
@@ -11,9 +11,13 @@
 
 /* If defined, will use clock_gettime, rather than gettimeofday */
 
+#include <linux/perf_event.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #ifdef USE_TOD
 #include <sys/time.h>
 #else
@@ -150,3 +154,58 @@ double get_counter()
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/* Data TLB load and store miss counters.  -1 when not available */
+static int tlb_fd[2];
+static int tlb_opened = 0;
+
+static int open_tlb_event(int op)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int start_tlb_counter()
+{
+    int i;
+    if (!tlb_opened)
+    {
+        tlb_fd[0] = open_tlb_event(PERF_COUNT_HW_CACHE_OP_READ);
+        tlb_fd[1] = open_tlb_event(PERF_COUNT_HW_CACHE_OP_WRITE);
+        tlb_opened = 1;
+    }
+    if (tlb_fd[0] < 0 && tlb_fd[1] < 0)
+        return 0;
+    for (i = 0; i < 2; i++)
+    {
+        if (tlb_fd[i] < 0)
+            continue;
+        ioctl(tlb_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(tlb_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return 1;
+}
+
+double get_tlb_counter()
+{
+    int i;
+    long long count;
+    double misses = 0.0;
+    for (i = 0; i < 2; i++)
+    {
+        if (tlb_fd[i] < 0)
+            continue;
+        ioctl(tlb_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(tlb_fd[i], &count, sizeof(count)) == (ssize_t)sizeof(count))
+            misses += count;
+    }
+    return misses;
+}
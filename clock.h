@@ -20,3 +20,11 @@ void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* TLB counter: measures data TLB misses of this thread, using the
+   hardware performance counters where the kernel allows it */
+/* Start the counter.  Returns 0 if TLB misses can't be counted */
+int start_tlb_counter();
+
+/* Get # data TLB misses (loads and stores) since counter started */
+double get_tlb_counter();
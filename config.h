@@ -76,7 +76,8 @@
 
 /*
  * Speeds measured relative to a benchmark.  Express thresholds
- * relative to benchmark throughput
+ * relative to benchmark throughput, which with -N is that of the
+ * built-in reference allocator on the same traces
  * Students get 0 points for this point or below (ops / sec)
  */
 #define MIN_SPEED_RATIO 0.50
@@ -109,6 +110,49 @@
 #define UTIL_WEIGHT .60
 #define UTIL_WEIGHT_CHECKPOINT .20
 
+/*
+ * Confidence level of the intervals reported in benchmark mode (-B)
+ */
+#define BENCH_CONFIDENCE 0.95
+
+/*
+ * Cache eviction for the warm and cold cache states (-k).  The eviction
+ * buffer is EVICT_FACTOR times the L2 (warm) or last level (cold) cache
+ * size found in sysfs, or the defaults below if sysfs doesn't say.
+ */
+#define EVICT_FACTOR 2
+#define DEFAULT_L2_BYTES (1L << 20)   /* 1 MB */
+#define DEFAULT_LLC_BYTES (32L << 20) /* 32 MB */
+
+/*
+ * Pages touched to displace the TLB in the cold cache state (-K)
+ */
+#define TLB_FLUSH_BYTES (256L << 20) /* 256 MB */
+
+/*
+ * Bytes between the payload bytes read and written in the application
+ * replay (-a), one per cache line
+ */
+#define TOUCH_STRIDE 64
+
+/*
+ * Most free lists the driver reports on, in soak mode (-R) and in the
+ * heap timeline (-g)
+ */
+#define MAX_FREE_LISTS 64
+
+/*
+ * Readings of the clock used to find its own cost, which is taken off
+ * each request's latency in the comparison of allocators (-x)
+ */
+#define LAT_TIMER_READS 1000
+
+/* Whole replays of each count of threads, of which the fastest counts (-j) */
+#define THREAD_RUNS 3
+
+/* Most threads a version 2 trace may record */
+#define MAX_TRACE_THREADS 1024
+
 /*
  * Max number of random values written to each allocation
  */
@@ -131,6 +175,17 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Most heaps that may exist at once, counting the default heap
+ */
+#define MAX_MEM_HEAPS 64
+
+/*
+ * Size of the pages backing the dense heap in huge page mode.  MAX_DENSE_HEAP
+ * should be a multiple of this
+ */
+#define HUGE_PAGE_SIZE (1 << 21) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -138,6 +193,12 @@
  */
 #define MAX_SPARSE_HEAP (1UL << 62) /* 1 EB */
 
+/*
+ * Size of the address window of each heap made by mem_heap_create in sparse
+ * mode.  Windows are placed below SPARSE_HEAP_START
+ */
+#define SPARSE_WINDOW_SIZE (1UL << 48) /* 256 TB */
+
 /*
  * Initial address of emulated heap
  */
@@ -148,10 +209,62 @@
  */
 #define SPARSE_PAGE_SIZE (1 << 10)
 
+/*
+ * Caches and TLB simulated by the access profile of the emulated heap (-M)
+ */
+#define PROF_LINE_SIZE 64
+#define PROF_L1_BYTES (32 << 10) /* 32 KB */
+#define PROF_L1_WAYS 8
+#define PROF_L2_BYTES (1 << 20) /* 1 MB */
+#define PROF_L2_WAYS 16
+#define PROF_PAGE_SIZE 4096
+#define PROF_TLB_ENTRIES 64
+#define PROF_TLB_WAYS 4
+
+/*
+ * Pages per mapping added to the emulation page pool, and the most
+ * memory the pool may use in all
+ */
+#define SPARSE_POOL_CHUNK 4096
+#define MAX_SPARSE_POOL (1UL << 30) /* 1 GB */
+
+/*
+ * log2 of the initial number of buckets in the page table
+ */
+#define SPARSE_TABLE_BITS 12
+
 /*
  * Maximum target load for hash table
  */
-#define HASH_LOAD 10.0
+#define HASH_LOAD 0.5
+
+/*
+ * Number of entries in the direct-mapped cache of page table lookups
+ */
+#define SPARSE_PAGE_CACHE 1024
+
+/********** Parameters controlling the interpositioning library, mm.so *****/
+/*
+ * Address space reserved at a time for a heap.  Only the part below the
+ * break is accessible
+ */
+#define MM_REGION_SIZE (1UL << 32) /* 4 GB */
+
+/*
+ * Bytes of a region made accessible at a time as the break rises
+ */
+#define MM_COMMIT_SIZE (1 << 20) /* 1 MB */
+
+/********** Parameters controlling the trace recorder, mm-record.so ********/
+/*
+ * Requests logged by a thread before its buffer is handed to the writer
+ */
+#define REC_BUF_RECORDS 16384
+
+/*
+ * How long the writer sleeps when no buffer is waiting to be written
+ */
+#define REC_POLL_NS 1000000 /* 1 ms */
 
 /***************** Parameters for looking up reference throughput *********/
 /*
@@ -1,7 +1,13 @@
 /* Compute time used by function f */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "clock.h"
 #include "fcyc.h"
@@ -14,6 +20,14 @@
 #define CACHE_BLOCK 32
 #define MIN_TICKS 1000
 #define MIN_REPS 8
+#define PIN_CPU -1
+#define WARMUP 2
+#define NSAMPLES 31
+#define BOOTSTRAP 1000
+#define CONFIDENCE 0.95
+#define OUTLIER_FENCE 1.5
+#define BOOTSTRAP_SEED 0x2545F4914F6CDD1DUL
+#define SYSFS_CACHE "/sys/devices/system/cpu/cpu0/cache"
 
 static long int kbest = K;
 static int clear_cache = CLEAR_CACHE;
@@ -24,8 +38,15 @@ static long int cache_block = CACHE_BLOCK;
 static long int min_reps = MIN_REPS;
 static long int min_ticks = MIN_TICKS;
 static double min_time = 0;
+static int pin_cpu = PIN_CPU;
+static long int warmup = WARMUP;
+static long int nsamples = NSAMPLES;
+static long int bootstrap = BOOTSTRAP;
+static double confidence = CONFIDENCE;
 
 static long int *cache_buf = NULL;
+static long int tlb_bytes = 0;
+static long int *tlb_buf = NULL;
 
 static double *values = NULL;
 static long int samplecount = 0;
@@ -98,21 +119,29 @@ static long int has_converged()
 
 static volatile long int sink = 0;
 
+/* Allocate a buffer backed by distinct physical pages.  Untouched pages
+   would all map to the kernel's shared zero page and evict nothing. */
+static long int *alloc_touched(long int bytes, const char *what)
+{
+    long int *buf = malloc(bytes);
+    if (!buf)
+    {
+        fprintf(stderr, "Fatal error.  Malloc returned null when trying to "
+                        "%s\n",
+                what);
+        exit(1);
+    }
+    memset(buf, 1, bytes);
+    return buf;
+}
+
 static void clear()
 {
     long int x = sink;
     long int *cptr, *cend;
     long int incr = cache_block / sizeof(long int);
     if (!cache_buf)
-    {
-        cache_buf = malloc(cache_bytes);
-        if (!cache_buf)
-        {
-            fprintf(stderr, "Fatal error.  Malloc returned null when trying to "
-                            "clear cache\n");
-            exit(1);
-        }
-    }
+        cache_buf = alloc_touched(cache_bytes, "clear cache");
     cptr = (long int *)cache_buf;
     cend = cptr + cache_bytes / sizeof(long int);
     while (cptr < cend)
@@ -120,31 +149,94 @@ static void clear()
         x += *cptr;
         cptr += incr;
     }
+    if (tlb_bytes > 0)
+    {
+        /* One access per page displaces the TLB entries of the test */
+        long int pincr = getpagesize() / sizeof(long int);
+        if (!tlb_buf)
+            tlb_buf = alloc_touched(tlb_bytes, "flush TLB");
+        cptr = tlb_buf;
+        cend = cptr + tlb_bytes / sizeof(long int);
+        while (cptr < cend)
+        {
+            x += *cptr;
+            cptr += pincr;
+        }
+    }
     sink = x;
 }
 
-double fcyc(test_funct f, void *args)
+/* Time one sample of reps calls.  Returns seconds per call.
+   When clearing the cache, every call starts cold and only the calls
+   themselves are timed. */
+static double time_sample(test_funct f, void *args, long reps)
 {
-    double result;
-    long reps = min_reps;
     long r;
-    double cyc;
-    /* Increase reps until get meaningful times */
     double sec = 0.0;
-    init_min_time();
-    while (sec < min_time)
+    if (!clear_cache)
     {
-        if (clear_cache)
-            clear();
         start_timer();
         for (r = 0; r < reps; r++)
         {
             f(args);
         }
-        sec = get_timer();
+        return get_timer() / reps;
+    }
+    for (r = 0; r < reps; r++)
+    {
+        clear();
+        start_timer();
+        f(args);
+        sec += get_timer();
+    }
+    return sec / reps;
+}
+
+/* Find a repetition count that makes one sample span min_time.
+   When clearing the cache, each call is timed on its own after a clear,
+   so more reps would only add clears; one call makes a sample. */
+static long calibrate_reps(test_funct f, void *args)
+{
+    long reps = min_reps;
+    double sec = 0.0;
+    if (clear_cache)
+        return 1;
+    init_min_time();
+    while (sec < min_time)
+    {
+        sec = time_sample(f, args, reps) * reps;
         if (sec < min_time)
             reps += reps;
     }
+    return reps;
+}
+
+double fcyc(test_funct f, void *args)
+{
+    double result;
+    long reps = min_reps;
+    long r;
+    double cyc;
+    /* Increase reps until get meaningful times.  When clearing the cache,
+       as in time_sample, each call is timed alone after a clear. */
+    double sec = 0.0;
+    init_min_time();
+    if (clear_cache)
+        reps = 1;
+    else
+    {
+        while (sec < min_time)
+        {
+            start_timer();
+            for (r = 0; r < reps; r++)
+            {
+                f(args);
+            }
+            sec = get_timer();
+            if (sec < min_time)
+                reps += reps;
+        }
+    }
     init_sampler();
     do
     {
@@ -171,37 +263,12 @@ double fsec(test_funct f, void *args)
 {
     double result;
     /* Increase reps until get meaningful times */
-    long reps = min_reps;
-    long r;
-    double sec = 0.0;
-    init_min_time();
-    while (sec < min_time)
-    {
-        if (clear_cache)
-            clear();
-        start_timer();
-        for (r = 0; r < reps; r++)
-        {
-            f(args);
-        }
-        sec = get_timer();
-        if (sec < min_time)
-            reps += reps;
-        //        printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
-    }
+    long reps = calibrate_reps(f, args);
+    double sec;
     init_sampler();
-    //    printf("\nuSecs (reps=%ld):", reps);
     do
     {
-        if (clear_cache)
-            clear();
-        start_timer();
-        for (r = 0; r < reps; r++)
-        {
-            f(args);
-        }
-        sec = get_timer() / reps;
-        //        printf(" %.3f", sec * 1e6);
+        sec = time_sample(f, args, reps);
         if (sec > 0.0)
             add_sample(sec);
     } while (!has_converged() && samplecount < maxsamples);
@@ -214,6 +281,256 @@ double fsec(test_funct f, void *args)
     return result;
 }
 
+/***********************************************************/
+/* Robust benchmarking                                     */
+
+/* Pin the calling thread to pin_cpu, if one has been requested */
+static void pin_thread()
+{
+    static int pinned_cpu = -1;
+    cpu_set_t set;
+    if (pin_cpu < 0 || pin_cpu == pinned_cpu)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Warning: could not pin to CPU %d\n", pin_cpu);
+        pin_cpu = -1;
+        return;
+    }
+    pinned_cpu = pin_cpu;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Linear interpolation between order statistics of sorted data */
+static double percentile(const double *sorted, long n, double p)
+{
+    double pos = p * (n - 1);
+    long lo = (long)pos;
+    if (lo >= n - 1)
+        return sorted[n - 1];
+    return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+/* Sort data and drop values outside the Tukey fences.  Returns new count */
+static long reject_outliers(double *data, long n)
+{
+    long i, kept = 0;
+    qsort(data, n, sizeof(double), compare_doubles);
+    if (n < 4)
+        return n;
+    double q1 = percentile(data, n, 0.25);
+    double q3 = percentile(data, n, 0.75);
+    double lo = q1 - OUTLIER_FENCE * (q3 - q1);
+    double hi = q3 + OUTLIER_FENCE * (q3 - q1);
+    for (i = 0; i < n; i++)
+    {
+        if (data[i] >= lo && data[i] <= hi)
+            data[kept++] = data[i];
+    }
+    return kept;
+}
+
+/* Private generator, so that resampling doesn't perturb random() */
+static uint64_t xorshift_state = BOOTSTRAP_SEED;
+
+static uint64_t xorshift()
+{
+    uint64_t x = xorshift_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return xorshift_state = x;
+}
+
+/* Median of a bootstrap resample of sorted data, using scratch space */
+static double resample_median(const double *data, long n, double *scratch)
+{
+    long i;
+    for (i = 0; i < n; i++)
+        scratch[i] = data[xorshift() % n];
+    qsort(scratch, n, sizeof(double), compare_doubles);
+    return percentile(scratch, n, 0.5);
+}
+
+/* Reject outliers from raw samples and fill in stats */
+static void summarize(double *data, long n, fstats_t *stats)
+{
+    long i, kept = reject_outliers(data, n);
+    double *scratch = calloc(kept, sizeof(double));
+    double *medians = calloc(bootstrap, sizeof(double));
+    if (!scratch || !medians)
+    {
+        fprintf(stderr, "Fatal error.  Calloc failed in summarize\n");
+        exit(1);
+    }
+    xorshift_state = BOOTSTRAP_SEED;
+    for (i = 0; i < bootstrap; i++)
+        medians[i] = resample_median(data, kept, scratch);
+    qsort(medians, bootstrap, sizeof(double), compare_doubles);
+    stats->median = percentile(data, kept, 0.5);
+    stats->ci_lo = percentile(medians, bootstrap, (1.0 - confidence) / 2);
+    stats->ci_hi = percentile(medians, bootstrap, (1.0 + confidence) / 2);
+    stats->samples = kept;
+    stats->outliers = n - kept;
+    free(scratch);
+    free(medians);
+}
+
+static double *alloc_samples(long n)
+{
+    double *data = calloc(n, sizeof(double));
+    if (!data)
+    {
+        fprintf(stderr, "Fatal error.  Calloc failed allocating samples\n");
+        exit(1);
+    }
+    return data;
+}
+
+double fsec_robust(test_funct f, void *args, fstats_t *stats)
+{
+    fstats_t local;
+    long i;
+    long reps;
+    double *data = alloc_samples(nsamples);
+    if (!stats)
+        stats = &local;
+    pin_thread();
+    reps = calibrate_reps(f, args);
+    for (i = 0; i < warmup; i++)
+        time_sample(f, args, reps);
+    for (i = 0; i < nsamples; i++)
+        data[i] = time_sample(f, args, reps);
+    summarize(data, nsamples, stats);
+    free(data);
+    return stats->median;
+}
+
+double fsec_compare(test_funct f, void *fargs, test_funct g, void *gargs,
+                    fcompare_t *cmp)
+{
+    fcompare_t local;
+    long i;
+    long freps, greps;
+    double *fdata = alloc_samples(nsamples);
+    double *gdata = alloc_samples(nsamples);
+    double *fscratch, *gscratch, *ratios;
+    if (!cmp)
+        cmp = &local;
+    pin_thread();
+    freps = calibrate_reps(f, fargs);
+    greps = calibrate_reps(g, gargs);
+    for (i = 0; i < warmup; i++)
+    {
+        time_sample(f, fargs, freps);
+        time_sample(g, gargs, greps);
+    }
+    /* Alternate the order within each pair, so neither always runs first */
+    for (i = 0; i < nsamples; i++)
+    {
+        if (i & 1)
+        {
+            gdata[i] = time_sample(g, gargs, greps);
+            fdata[i] = time_sample(f, fargs, freps);
+        }
+        else
+        {
+            fdata[i] = time_sample(f, fargs, freps);
+            gdata[i] = time_sample(g, gargs, greps);
+        }
+    }
+    summarize(fdata, nsamples, &cmp->a);
+    summarize(gdata, nsamples, &cmp->b);
+
+    /* Bootstrap the ratio of medians, resampling both sides independently */
+    fscratch = alloc_samples(cmp->a.samples);
+    gscratch = alloc_samples(cmp->b.samples);
+    ratios = alloc_samples(bootstrap);
+    xorshift_state = BOOTSTRAP_SEED;
+    for (i = 0; i < bootstrap; i++)
+    {
+        double fm = resample_median(fdata, cmp->a.samples, fscratch);
+        double gm = resample_median(gdata, cmp->b.samples, gscratch);
+        ratios[i] = fm / gm;
+    }
+    qsort(ratios, bootstrap, sizeof(double), compare_doubles);
+    cmp->ratio = cmp->a.median / cmp->b.median;
+    cmp->ratio_lo = percentile(ratios, bootstrap, (1.0 - confidence) / 2);
+    cmp->ratio_hi = percentile(ratios, bootstrap, (1.0 + confidence) / 2);
+    cmp->significant = cmp->ratio_lo > 1.0 || cmp->ratio_hi < 1.0;
+    free(fdata);
+    free(gdata);
+    free(fscratch);
+    free(gscratch);
+    free(ratios);
+    return cmp->ratio;
+}
+
+/*
+ * forked_sample - Run f once in a child process, after prep, and return
+ *     the time taken by f.  The child's memory starts as a copy-on-write
+ *     image of ours, so whatever f changes is gone when it exits.
+ */
+static double forked_sample(test_funct prep, test_funct f, void *args)
+{
+    int fd[2], status;
+    double sec = -1.0;
+    pid_t pid;
+
+    if (pipe(fd) < 0 || (pid = fork()) < 0)
+    {
+        fprintf(stderr, "Fatal error.  Couldn't fork a timing process\n");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        close(fd[0]);
+        if (prep)
+            prep(args);
+        if (clear_cache)
+            clear();
+        start_timer();
+        f(args);
+        sec = get_timer();
+        _exit(write(fd[1], &sec, sizeof(sec)) == (ssize_t)sizeof(sec) ? 0 : 1);
+    }
+    close(fd[1]);
+    if (read(fd[0], &sec, sizeof(sec)) != (ssize_t)sizeof(sec))
+        sec = -1.0;
+    close(fd[0]);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || sec < 0)
+    {
+        fprintf(stderr, "Fatal error.  Timing process failed\n");
+        exit(1);
+    }
+    return sec;
+}
+
+double fsec_forked(test_funct prep, test_funct f, void *args,
+                   fstats_t *stats)
+{
+    fstats_t local;
+    long i;
+    double *data = alloc_samples(nsamples);
+    if (!stats)
+        stats = &local;
+    pin_thread();
+    for (i = 0; i < nsamples; i++)
+        data[i] = forked_sample(prep, f, args);
+    summarize(data, nsamples, stats);
+    free(data);
+    return stats->median;
+}
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -229,7 +546,8 @@ void set_fcyc_min_reps(int r)
     min_reps = r;
 }
 
-/* When set, will run code to clear cache before each measurement
+/* When set, will run code to clear cache before each call of the test
+   function.  Only the calls themselves are timed.
    Default = 0
 */
 void set_fcyc_clear_cache(int clear)
@@ -285,3 +603,112 @@ void set_fcyc_epsilon(double epsilon_arg)
 {
     epsilon = epsilon_arg;
 }
+
+/* Pin the measuring thread to this core.  Negative means don't pin.
+   Default = -1
+*/
+void set_fcyc_cpu(int cpu)
+{
+    pin_cpu = cpu;
+}
+
+/* Number of untimed runs before sampling starts
+   Default = 2
+*/
+void set_fcyc_warmup(long int warmup_arg)
+{
+    warmup = warmup_arg;
+}
+
+/* Number of samples collected by the robust measurement routines
+   Default = 31
+*/
+void set_fcyc_samples(long int samples)
+{
+    nsamples = samples;
+}
+
+/* Number of bootstrap resamples used to compute confidence intervals
+   Default = 1000
+*/
+void set_fcyc_bootstrap(long int resamples)
+{
+    bootstrap = resamples;
+}
+
+/* Confidence level of the reported intervals
+   Default = 0.95
+*/
+void set_fcyc_confidence(double level)
+{
+    confidence = level;
+}
+
+/* Touch one word in every page of a buffer this large when clearing the
+   cache, to also displace TLB entries.  0 disables.
+   Default = 0
+*/
+void set_fcyc_flush_tlb(long int bytes)
+{
+    if (bytes != tlb_bytes)
+    {
+        tlb_bytes = bytes;
+        if (tlb_buf)
+        {
+            free(tlb_buf);
+            tlb_buf = NULL;
+        }
+    }
+}
+
+/* Read one value from a sysfs cache attribute file */
+static int read_cache_attr(int index, const char *attr, char *buf, int len)
+{
+    char path[256];
+    FILE *fp;
+    snprintf(path, sizeof(path), "%s/index%d/%s", SYSFS_CACHE, index, attr);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if (!fgets(buf, len, fp))
+        buf[0] = 0;
+    fclose(fp);
+    return 1;
+}
+
+/* Size of the data or unified cache at the given level, in bytes.
+   Level 0 selects the last level cache.  Returns 0 if unknown.
+*/
+long int fcyc_cache_bytes(int level)
+{
+    char buf[64];
+    int index;
+    int best_level = 0;
+    long int best_bytes = 0;
+    for (index = 0; read_cache_attr(index, "level", buf, sizeof(buf));
+         index++)
+    {
+        int lvl = atoi(buf);
+        char unit;
+        long int bytes;
+        if (!read_cache_attr(index, "type", buf, sizeof(buf)) ||
+            strncmp(buf, "Instruction", 11) == 0)
+            continue;
+        if (level != 0 && lvl != level)
+            continue;
+        if (level == 0 && lvl < best_level)
+            continue;
+        if (!read_cache_attr(index, "size", buf, sizeof(buf)))
+            continue;
+        bytes = strtol(buf, NULL, 10);
+        unit = buf[strspn(buf, "0123456789")];
+        if (unit == 'K')
+            bytes <<= 10;
+        else if (unit == 'M')
+            bytes <<= 20;
+        else if (unit == 'G')
+            bytes <<= 30;
+        best_level = lvl;
+        best_bytes = bytes;
+    }
+    return best_bytes;
+}
@@ -22,7 +22,8 @@ void set_fcyc_min_ticks(int t);
 /* Sets minimum number of repetitions of function.  Default = 8 */
 void set_fcyc_min_reps(int r);
 
-/* When set, will run code to clear cache before each measurement
+/* When set, will run code to clear cache before each call of the test
+   function.  Only the calls themselves are timed.
    Default = 0
 */
 void set_fcyc_clear_cache(int clear);
@@ -37,6 +38,18 @@ void set_fcyc_cache_size(long int bytes);
 */
 void set_fcyc_cache_block(long int bytes);
 
+/* Touch one word in every page of a buffer this large when clearing the
+   cache, to also displace TLB entries.  0 disables.
+   Default = 0
+*/
+void set_fcyc_flush_tlb(long int bytes);
+
+/* Size of the data or unified cache at the given level, in bytes, as
+   reported by sysfs.  Level 0 selects the last level cache.
+   Returns 0 if unknown.
+*/
+long int fcyc_cache_bytes(int level);
+
 /* When set, will attempt to compensate for timer interrupt overhead
    Default = 0
 */
@@ -57,3 +70,73 @@ void set_fcyc_maxsamples(long int maxsamples);
    Default = 0.01
 */
 void set_fcyc_epsilon(double epsilon);
+
+/***********************************************************/
+/* Robust benchmarking                                     */
+
+/* Summary of a robust timing measurement.  All times in seconds per call */
+typedef struct
+{
+    double median; /* Median of the samples that survived outlier rejection */
+    double ci_lo;  /* Lower end of the bootstrap confidence interval */
+    double ci_hi;  /* Upper end of the bootstrap confidence interval */
+    long samples;  /* Number of samples kept */
+    long outliers; /* Number of samples rejected as outliers */
+} fstats_t;
+
+/* Result of an interleaved comparison of two functions */
+typedef struct
+{
+    fstats_t a;      /* Statistics for the first function */
+    fstats_t b;      /* Statistics for the second function */
+    double ratio;    /* median(a) / median(b) */
+    double ratio_lo; /* Lower end of the bootstrap interval for the ratio */
+    double ratio_hi; /* Upper end of the bootstrap interval for the ratio */
+    int significant; /* Nonzero when the interval for the ratio excludes 1 */
+} fcompare_t;
+
+/* Compute the median time used by function f, after pinning to the
+   configured core, running warmup iterations and rejecting outliers.
+   When stats is not NULL, it is filled in with the confidence interval.
+*/
+double fsec_robust(test_funct f, void *args, fstats_t *stats);
+
+/* Time functions f and g with interleaved samples, so that drift in the
+   machine state affects both equally.  Returns median(f) / median(g).
+*/
+double fsec_compare(test_funct f, void *fargs, test_funct g, void *gargs,
+                    fcompare_t *cmp);
+
+/* Time one call of function f in each of a number of forked copies of this
+   process, so that every sample starts from the state at the time of the
+   call, however f changes it.  prep, if not NULL, runs untimed in each copy
+   first, e.g. to take private copies of pages f will write.  Returns the
+   median time; stats as for fsec_robust.
+*/
+double fsec_forked(test_funct prep, test_funct f, void *args,
+                   fstats_t *stats);
+
+/* Pin the measuring thread to this core.  Negative means don't pin.
+   Default = -1
+*/
+void set_fcyc_cpu(int cpu);
+
+/* Number of untimed runs before sampling starts
+   Default = 2
+*/
+void set_fcyc_warmup(long int warmup);
+
+/* Number of samples collected by the robust measurement routines
+   Default = 31
+*/
+void set_fcyc_samples(long int samples);
+
+/* Number of bootstrap resamples used to compute confidence intervals
+   Default = 1000
+*/
+void set_fcyc_bootstrap(long int resamples);
+
+/* Confidence level of the reported intervals
+   Default = 0.95
+*/
+void set_fcyc_confidence(double level);
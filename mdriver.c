@@ -7,14 +7,20 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,11 +31,13 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#include "btree.h"
+#include "cachesim.h"
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
 #include "mm.h"
-#include "stree.h"
 
 /**********************
  * Constants and macros
@@ -37,9 +45,10 @@
 
 /* Misc */
 #define MAXLINE 1024 /* max string size */
-#define HDRLINES 4   /* number of header lines in a trace file */
-#define LINENUM(i)                                                             \
-    (i + HDRLINES + 1) /* cnvt trace request nums to linenums (origin 1) */
+#define HDRLINES 4   /* number of header lines in a version 1 trace file */
+#define BUMP_CHUNK (1 << 20) /* bytes the bump allocator stub asks for */
+/* cnvt trace request nums to linenums (origin 1) */
+#define LINENUM(trace, i) ((i) + HDRLINES + ((trace)->version > 1) + 1)
 
 #ifndef REF_ONLY
 #define REF_ONLY 0
@@ -57,6 +66,16 @@ typedef enum
     WPERF
 } weight_t;
 
+/* cache state in which throughput is measured */
+typedef enum
+{
+    CACHE_HOT,  /* back-to-back replays, caches hold the previous run */
+    CACHE_WARM, /* private caches evicted before each replay */
+    CACHE_COLD, /* last level cache, optionally TLB, evicted as well */
+    NUM_CACHE_STATES,
+    CACHE_ALL = NUM_CACHE_STATES /* measure under each state in turn */
+} cache_state_t;
+
 /******************************
  * The key compound data types
  *****************************/
@@ -69,40 +88,46 @@ typedef enum
  */
 
 /*
- * Records the extent of each block's payload.
- * Organized as doubly linked list
- */
-typedef struct range_t
-{
-    char *lo;   /* low payload address */
-    char *hi;   /* high payload address */
-    int index;  /* same index as free; for debugging */
-    struct range_t *next;
-    struct range_t *prev;
-} range_t;
-
-/*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * All information about set of ranges, represented as a B+ tree of
+ * range_t records (see btree.h) keyed by lo addresses
  */
 typedef struct
 {
-    range_t *list;
-    tree_t *lo_tree;
+    btree_t *tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct
+/* Type of a single trace operation (allocator request) */
+typedef enum
 {
-    enum
-    {
-        ALLOC,
-        FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
-} traceop_t;
+    ALLOC,
+    FREE,
+    REALLOC
+} optype_t;
+
+/*
+ * Characterizes a single trace operation, packed into 32 bits so the
+ * driver's own footprint inside the timed loops stays small: the type
+ * of request in the top OP_TYPE_BITS bits, and the index for free() to
+ * use later, sign-extended so that -1 means the null pointer, in the
+ * rest.  The byte size of alloc/realloc requests is kept in a separate
+ * column of the trace.
+ */
+typedef uint32_t traceop_t;
+
+#define OP_TYPE_BITS 2
+#define OP_INDEX_BITS (32 - OP_TYPE_BITS)
+#define OP_MAX_INDEX ((1 << (OP_INDEX_BITS - 1)) - 1)
+#define OP_PACK(type, index)                                                   \
+    (((uint32_t)(type) << OP_INDEX_BITS) |                                     \
+     ((uint32_t)(index) & ((1u << OP_INDEX_BITS) - 1)))
+#define OP_TYPE(op) ((optype_t)((op) >> OP_INDEX_BITS))
+#define OP_INDEX(op) ((int32_t)((op) << OP_TYPE_BITS) >> OP_TYPE_BITS)
+
+/*
+ * The timed loops prefetch the block slot of the request this far
+ * ahead.  The ops array is padded with as many free(NULL) requests.
+ */
+#define PREFETCH_DIST 8
 
 /* Holds the information for one trace file */
 typedef struct
@@ -112,12 +137,35 @@ typedef struct
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
-    traceop_t *ops;       /* array of requests */
-    char **blocks;        /* array of ptrs returned by malloc/realloc... */
+    traceop_t *ops;       /* array of packed requests... */
+    size_t *sizes;        /* ... and the byte size of each one */
+    char **blocks;        /* array of ptrs returned by malloc/realloc; */
+                          /* blocks[-1] is always NULL, for free(NULL) */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    int version;          /* trace format version, 1 or 2 */
+    int num_threads;      /* number of threads recorded in the trace */
+    uint16_t *tids;       /* version 2: thread of each request, ... */
+    uint64_t *times;      /* ... and its time in ns */
+    uint64_t time_lo;     /* earliest time of any request */
+    uint64_t time_hi;     /* latest time of any request */
 } trace_t;
 
+/*
+ * An allocator the driver can replay traces against, for the comparison
+ * of several allocators in one run (-x)
+ */
+typedef struct
+{
+    const char *name;
+    bool (*init)(void);       /* reset the heap and set up, or NULL */
+    void *(*malloc_fn)(size_t);
+    void *(*realloc_fn)(void *, size_t);
+    void (*free_fn)(void *);
+    bool (*checkheap)(int);   /* NULL if the heap can't be checked */
+    size_t (*heapsize)(void); /* NULL if the heap size is not known */
+} allocator_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -127,8 +175,59 @@ typedef struct
 {
     trace_t *trace;
     range_set_t *ranges;
+    int first, last;          /* requests replayed when timing a window (-w) */
+    size_t touch_bytes;       /* heap bytes to copy before timing a window */
+    const allocator_t *alloc; /* allocator being compared (-x) */
 } speed_t;
 
+/*
+ * Where the bytes of the heap go at one point in a trace (-F).  Free
+ * blocks are counted in FRAG_BINS size classes, up to the sizes in
+ * frag_bin_max.
+ */
+#define FRAG_BINS 5
+static const size_t frag_bin_max[FRAG_BINS] = {64, 512, 4096, 32768,
+                                               SIZE_MAX};
+static const char *frag_bin_names[FRAG_BINS] = {"<=64", "<=512", "<=4K",
+                                                "<=32K", "more"};
+
+typedef struct
+{
+    size_t heap;     /* heap size */
+    size_t payload;  /* bytes requested by the trace */
+    size_t overhead; /* headers, footers, and bytes outside any block */
+    size_t padding;  /* bytes of allocated blocks beyond the request */
+    size_t free_bytes[FRAG_BINS]; /* bytes in free blocks of each class */
+} frag_t;
+
+/*
+ * Emulated heap accesses made by one kind of request (-M).  The first
+ * kind is mm_init; the others follow optype_t.
+ */
+typedef enum
+{
+    PROF_INIT,
+    PROF_MALLOC,
+    PROF_FREE,
+    PROF_REALLOC,
+    NUM_PROF_KINDS
+} prof_kind_t;
+
+static const char *prof_kind_names[] = {"init", "malloc", "free", "realloc"};
+
+typedef struct
+{
+    long ops;       /* requests of this kind */
+    long accesses;  /* loads, stores, and memcpy or memset spans */
+    long lines;     /* distinct cache lines touched, summed over requests */
+    long pages;     /* distinct pages touched, summed over requests */
+    long line_refs; /* cache lines referred to by the accesses */
+    long l1_hits;
+    long l2_hits;
+    long page_refs; /* pages referred to by the accesses */
+    long tlb_hits;
+} prof_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct
 {
@@ -145,6 +244,59 @@ typedef struct
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only in robust benchmark mode (-B) */
+    double secs_lo;      /* low end of the confidence interval for secs */
+    double secs_hi;      /* high end of the confidence interval for secs */
+    fcompare_t libc_cmp; /* interleaved comparison with libc (-B with -l) */
+
+    /* defined only when measuring every cache state (-k all) */
+    double tput_cache[NUM_CACHE_STATES]; /* Kops/s in each cache state */
+
+    /* defined only when measuring the driver's own overhead (-I) */
+    double interp_secs; /* secs needed to interpret the trace alone */
+
+    /* defined only when calibrating against the bump allocator (-b) */
+    double calib_secs; /* secs for mm, measured as for the bump allocator */
+    double calib_lo;   /* confidence interval for calib_secs */
+    double calib_hi;
+    double bump_secs; /* secs needed to replay with the bump allocator */
+    double bump_lo;   /* confidence interval for bump_secs */
+    double bump_hi;
+
+    /* defined only when comparing huge and normal pages (-H) */
+    double huge_secs;   /* secs needed to run the trace with huge pages */
+    double tlb_misses;  /* dTLB misses in one run, or -1 if not counted */
+    double huge_misses; /* dTLB misses in one run with huge pages */
+
+    /* defined only when timing a window of the trace (-w) */
+    int window_first;   /* the window, cut off at the end of the trace */
+    int window_last;
+    int window_ops;     /* number of requests in the window */
+    double window_secs; /* secs needed to replay the window alone */
+    double window_lo;   /* confidence interval for window_secs */
+    double window_hi;
+
+    /* defined only when breaking down fragmentation (-F) */
+    frag_t frag_end;  /* at the end of the trace */
+    frag_t frag_peak; /* when the most payload was allocated */
+
+    /* defined only when profiling emulated accesses (-M) */
+    prof_t prof[NUM_PROF_KINDS];
+
+    /* defined only when measuring resident pages (-E) */
+    size_t heap_peak;    /* heap size when the most payload was allocated */
+    size_t rss_peak;     /* heap bytes resident then ... */
+    size_t written_peak; /* ... and heap bytes written */
+    size_t rss_end;      /* the same at the end of the trace */
+    size_t written_end;
+    double rss_util;     /* peak payload over resident bytes at the peak */
+
+    /* defined only in the application replay (-a) */
+    double app_secs;    /* secs needed to replay touching payloads */
+    double alloc_dist;  /* median distance between consecutive mallocs */
+    double near_allocs; /* fraction of those within one page */
+    double live_span;   /* span of the live blocks at the peak / payload */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -199,6 +351,119 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* If nonzero, time with fsec_robust using this many samples (-B) */
+static long bench_samples = 0;
+/* If set, compare mm and libc with interleaved samples (-B with -l) */
+static bool compare_libc = false;
+
+/* Cache state for throughput measurements (-k), and TLB flushing (-K) */
+static const char *cache_state_names[] = {"hot", "warm", "cold", "all"};
+static cache_state_t cache_state = CACHE_HOT;
+static bool flush_tlb = false;
+
+/* If set, also time the trace interpretation alone (-I) */
+static bool measure_interp = false;
+
+/* If set, subtract the time of a bump allocator replay (-b) */
+static bool calibrate = false;
+
+/* If set, also measure with the heap backed by huge pages (-H) */
+static bool compare_hugepages = false;
+
+/*
+ * If window_first >= 0, also time requests [window_first, window_last)
+ * alone, from a snapshot of the heap after the earlier ones (-w).  A
+ * negative window_last means the end of the trace.
+ */
+static int window_first = -1;
+static int window_last = -1;
+
+/* If nonzero, replay the traces this many times on one heap (-R) */
+static int soak_rounds = 0;
+
+/* If nonzero, write a heap timeline sampled every this many ops (-g) */
+static int timeline_interval = 0;
+
+/* If set, break the heap down into payload, overhead and free (-F) */
+static bool frag_report = false;
+
+/* If set, profile the allocator's emulated heap accesses (-M) */
+static bool profile_mode = false;
+
+/*
+ * If touch_fraction > 0, also replay touching that fraction of each
+ * payload after it is allocated and before it is freed, and doing
+ * think_iters steps of busywork after each request (-a)
+ */
+static double touch_fraction = 0.0;
+static int think_iters = 0;
+
+/* If set, measure the resident and written pages of the heap (-E) */
+static bool rss_report = false;
+static bool rss_written_known = true; /* Can written pages be told apart? */
+
+/*
+ * mm-naive.c, linked under a prefix when the driver is built with
+ * objs/mm-naive-cmp.o.  Otherwise these are NULL.
+ */
+extern bool naive_mm_init(void) __attribute__((weak));
+extern void *naive_mm_malloc(size_t size) __attribute__((weak));
+extern void *naive_mm_realloc(void *ptr, size_t size) __attribute__((weak));
+extern void naive_mm_free(void *ptr) __attribute__((weak));
+extern bool naive_mm_checkheap(int line) __attribute__((weak));
+
+static bool mm_start(void);
+static bool naive_start(void);
+static void *mm_realloc_unchecked(void *ptr, size_t size);
+static bool ref_start(void);
+static void *ref_malloc(size_t size);
+static void *ref_realloc(void *ptr, size_t size);
+static void ref_free(void *ptr);
+
+/* The allocators that can be compared (-x) */
+static const allocator_t allocators[] = {
+    {"mm", mm_start, mm_malloc, mm_realloc_unchecked, mm_free, mm_checkheap,
+     mem_heapsize},
+    {"naive", naive_start, naive_mm_malloc, naive_mm_realloc, naive_mm_free,
+     naive_mm_checkheap, mem_heapsize},
+    {"libc", NULL, malloc, realloc, free, NULL, NULL},
+    {"ref", ref_start, ref_malloc, ref_realloc, ref_free, NULL, mem_heapsize},
+};
+#define NUM_ALLOCATORS ((int)(sizeof(allocators) / sizeof(allocators[0])))
+
+/*
+ * If set, score throughput against the built-in reference allocator
+ * instead of the benchmark of throughputs.txt or mdriver-ref (-N)
+ */
+static bool builtin_ref = false;
+static double *builtin_ref_tput = NULL; /* its Kops/s on each trace */
+
+/*
+ * If num_threads > 0, replay the traces on up to that many threads, each
+ * with its own copy, or with thread_partition set, its share of the
+ * block ids (-j), using libc or the allocator in thread_lib (-L)
+ */
+static int num_threads = 0;
+static bool thread_partition = false;
+static const char *thread_lib = NULL;
+static const allocator_t *thread_alloc; /* the allocator replayed */
+
+/*
+ * If not REC_NONE, replay each trace on the threads it records, in
+ * causal order or at the recorded timing (-y)
+ */
+typedef enum
+{
+    REC_NONE,
+    REC_CAUSAL,
+    REC_TIMED
+} rec_mode_t;
+static rec_mode_t recorded_mode = REC_NONE;
+
+/* Indices into allocators of those to compare, if any (-x) */
+static int cmp_allocs[NUM_ALLOCATORS];
+static int num_cmp_allocs = 0;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -255,11 +520,51 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, FILE *timeline,
+                           stats_t *stats);
+static void measure_frag(trace_t *trace, frag_t *frag);
+static void eval_mm_profile(trace_t *trace, prof_t *prof);
+static FILE *open_timeline(const trace_t *trace);
+static void timeline_row(FILE *fp, int op, size_t live_bytes);
 static void eval_mm_speed(void *ptr);
+static void eval_null_speed(void *ptr);
+static void eval_bump_speed(void *ptr);
+static void eval_ref_speed(void *ptr);
+static void measure_once(test_funct f, speed_t *params, stats_t *stats);
+static void measure_speed(test_funct f, speed_t *params, stats_t *stats);
+static double count_tlb_misses(test_funct f, speed_t *params);
+static void measure_window(speed_t *params, stats_t *stats);
+static void eval_app_speed(void *ptr);
+static void eval_locality(trace_t *trace, stats_t *stats);
+static void soak_test(int num_tracefiles, const char *tracedir,
+                      char **tracefiles, const stats_t *mm_stats);
+static int find_allocator(const char *name);
+static void parse_allocators(const char *list);
+static bool cmp_replay(trace_t *trace, const allocator_t *a, size_t *peak,
+                       uint32_t *ns);
+static void compare_allocators(int num_tracefiles, const char *tracedir,
+                               char **tracefiles);
+static const allocator_t *load_thread_alloc(const char *path);
+static void thread_test(int num_tracefiles, const char *tracedir,
+                        char **tracefiles);
+static void recorded_test(int num_tracefiles, const char *tracedir,
+                          char **tracefiles);
+static void set_cache_state(cache_state_t state);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_frag(const char *when, const frag_t *frag);
+static void print_profile(int n, stats_t *stats);
+static void print_rss(int n, stats_t *stats);
+static void print_app(int n, stats_t *stats);
+static void print_fcompare(const fcompare_t *cmp, const char *name);
+static void print_libc_comparison(int n, stats_t *stats);
+static void print_cache_states(int n, stats_t *stats);
+static void print_interp_overhead(int n, stats_t *stats);
+static void print_calibration(int n, stats_t *stats);
+static void print_hugepages(int n, stats_t *stats);
+static void print_window(int n, stats_t *stats);
+static void print_builtin_ref(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -282,6 +587,8 @@ static void timeout_handler(int sig __attribute__((unused)))
 /* Compute throughput from reference implementation */
 static double lookup_ref_throughput(bool checkpoint);
 static double measure_ref_throughput(bool checkpoint);
+static double measure_builtin_ref(int num_tracefiles, const char *tracedir,
+                                  char **tracefiles);
 
 /*
  * Run the tests; return the number of tests run (may be less than
@@ -336,21 +643,65 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            FILE *timeline = timeline_interval > 0 ? open_timeline(trace) : NULL;
+            mm_stats[i].util = eval_mm_util(trace, i, timeline, &mm_stats[i]);
+            if (timeline)
+                fclose(timeline);
+            if (profile_mode)
+                eval_mm_profile(trace, mm_stats[i].prof);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
-            mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+            if (sparse_mode)
+                mm_stats[i].secs = 1.0;
+            else
+                measure_speed(eval_mm_speed, speed_params, &mm_stats[i]);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (compare_libc && !sparse_mode)
+                fsec_compare(eval_mm_speed, speed_params, eval_libc_speed,
+                             speed_params, &mm_stats[i].libc_cmp);
+            if (measure_interp && !sparse_mode)
+                mm_stats[i].interp_secs = fsec(eval_null_speed, speed_params);
+            if (calibrate && !sparse_mode)
+            {
+                /* Both by median, apart from the scored measurement */
+                fstats_t fstats;
+
+                mm_stats[i].calib_secs =
+                    fsec_robust(eval_mm_speed, speed_params, &fstats);
+                mm_stats[i].calib_lo = fstats.ci_lo;
+                mm_stats[i].calib_hi = fstats.ci_hi;
+                mm_stats[i].bump_secs =
+                    fsec_robust(eval_bump_speed, speed_params, &fstats);
+                mm_stats[i].bump_lo = fstats.ci_lo;
+                mm_stats[i].bump_hi = fstats.ci_hi;
+            }
+            if (compare_hugepages && !sparse_mode)
+            {
+                stats_t huge_stats = mm_stats[i];
+
+                mm_stats[i].tlb_misses =
+                    count_tlb_misses(eval_mm_speed, speed_params);
+                mem_set_hugepages(true);
+                measure_once(eval_mm_speed, speed_params, &huge_stats);
+                mm_stats[i].huge_secs = huge_stats.secs;
+                mm_stats[i].huge_misses =
+                    count_tlb_misses(eval_mm_speed, speed_params);
+                mem_set_hugepages(false);
+            }
+            if (window_first >= 0 && !sparse_mode)
+                measure_window(speed_params, &mm_stats[i]);
+            if (touch_fraction > 0 && !sparse_mode)
+            {
+                stats_t app_stats = mm_stats[i];
+
+                measure_once(eval_app_speed, speed_params, &app_stats);
+                mm_stats[i].app_secs = app_stats.secs;
+                eval_locality(trace, &mm_stats[i]);
+            }
         }
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
         free_trace(trace);
         free_range_set(ranges);
 
@@ -388,11 +739,18 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "a:d:f:c:g:j:s:t:v:w:x:y:B:L:P:R:W:k:bhpCEFMNOVAlDHIKT")) != EOF)
     {
         switch (c)
         {
 
+        case 'a': /* Application replay: touch payloads, think */
+            if (sscanf(optarg, "%lf:%d", &touch_fraction, &think_iters) < 1 ||
+                touch_fraction <= 0 || touch_fraction > 1 || think_iters < 0)
+                app_error("-a expects <fraction>[:<think>], with 0 < "
+                          "fraction <= 1\n");
+            break;
+
         case 'A': /* Hidden Autolab driver argument */
             autograder = true;
             break;
@@ -449,6 +807,114 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'B': /* Robust benchmark mode with n samples */
+            bench_samples = atol(optarg);
+            if (bench_samples < 1)
+                app_error("-B requires at least one sample\n");
+            set_fcyc_samples(bench_samples);
+            set_fcyc_confidence(BENCH_CONFIDENCE);
+            break;
+
+        case 'P': /* Pin measurements to a core */
+            set_fcyc_cpu(atoi(optarg));
+            break;
+
+        case 'W': /* Warmup iterations before sampling */
+            set_fcyc_warmup(atol(optarg));
+            break;
+
+        case 'k': /* Cache state for throughput measurements */
+            for (i = 0; i <= CACHE_ALL; i++)
+            {
+                if (strcmp(optarg, cache_state_names[i]) == 0)
+                    break;
+            }
+            if (i > CACHE_ALL)
+                app_error("-k expects one of hot, warm, cold or all\n");
+            cache_state = i;
+            break;
+
+        case 'K': /* Also flush the TLB in the cold cache state */
+            flush_tlb = true;
+            break;
+
+        case 'I': /* Report the driver's trace interpretation overhead */
+            measure_interp = true;
+            break;
+
+        case 'b': /* Calibrate against the bump allocator stub */
+            calibrate = true;
+            break;
+
+        case 'H': /* Compare normal and huge pages for the heap */
+            compare_hugepages = true;
+            break;
+
+        case 'w': /* Time a window of each trace from a snapshot */
+            if (sscanf(optarg, "%d:%d", &window_first, &window_last) < 1 ||
+                window_first < 0)
+                app_error("-w expects <first>[:<last>]\n");
+            if (window_last >= 0 && window_last <= window_first)
+                app_error("-w: the window %d:%d is empty\n", window_first,
+                          window_last);
+            break;
+
+        case 'g': /* Write a heap timeline every n ops */
+            timeline_interval = atoi(optarg);
+            if (timeline_interval < 1)
+                app_error("-g requires an interval of at least one op\n");
+            break;
+
+        case 'E': /* Measure resident and written heap pages */
+            rss_report = true;
+            break;
+
+        case 'F': /* Break down fragmentation */
+            frag_report = true;
+            break;
+
+        case 'M': /* Profile the emulated heap accesses */
+            profile_mode = true;
+            break;
+
+        case 'N': /* Score against the built-in reference allocator */
+            builtin_ref = true;
+            break;
+
+        case 'R': /* Soak: replay the traces n times on one heap */
+            soak_rounds = atoi(optarg);
+            if (soak_rounds < 1)
+                app_error("-R requires at least one round\n");
+            break;
+
+        case 'j': /* Replay on up to n threads */
+        {
+            char mode[MAXLINE] = "";
+
+            if (sscanf(optarg, "%d:%s", &num_threads, mode) < 1 ||
+                num_threads < 1 || (mode[0] && strcmp(mode, "part") != 0))
+                app_error("-j expects <threads>[:part]\n");
+            thread_partition = mode[0] != '\0';
+            break;
+        }
+
+        case 'y': /* Replay on the threads the traces record */
+            if (strcmp(optarg, "causal") == 0)
+                recorded_mode = REC_CAUSAL;
+            else if (strcmp(optarg, "timed") == 0)
+                recorded_mode = REC_TIMED;
+            else
+                app_error("-y expects causal or timed\n");
+            break;
+
+        case 'L': /* Thread-safe allocator library for -j and -y */
+            thread_lib = optarg;
+            break;
+
+        case 'x': /* Compare allocators side by side */
+            parse_allocators(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -484,6 +950,28 @@ int main(int argc, char **argv)
         alarm(set_timeout);
     }
 
+    compare_libc = run_libc && bench_samples > 0;
+
+    if (frag_report && !mm_walk_heap)
+        app_error("-F needs an allocator that defines mm_walk_heap\n");
+    if (profile_mode && !sparse_mode)
+        app_error("-M needs the emulated driver, mdriver-emulate\n");
+    if (rss_report && sparse_mode)
+        app_error("-E needs the dense heap of mdriver\n");
+    if (touch_fraction > 0 && sparse_mode)
+        app_error("-a needs the dense heap of mdriver\n");
+    if (num_cmp_allocs > 0 && sparse_mode)
+        app_error("-x needs the dense heap of mdriver\n");
+    if (builtin_ref && sparse_mode)
+        app_error("-N needs the dense heap of mdriver\n");
+    if ((num_threads > 0 || recorded_mode != REC_NONE) && sparse_mode)
+        app_error("-j and -y need the dense heap of mdriver\n");
+    if (num_threads > 0 || recorded_mode != REC_NONE)
+        thread_alloc = load_thread_alloc(thread_lib);
+
+    if (cache_state != CACHE_ALL)
+        set_cache_state(cache_state);
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -511,7 +999,9 @@ int main(int argc, char **argv)
                 speed_params.trace = trace;
                 if (verbose > 1)
                     printf("and performance.\n");
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                measure_speed(eval_libc_speed, &speed_params, &libc_stats[i]);
+                libc_stats[i].tput =
+                    libc_stats[i].ops / (libc_stats[i].secs * 1000.0);
             }
             free_trace(trace);
         }
@@ -523,6 +1013,8 @@ int main(int argc, char **argv)
             printf("\nResults for libc malloc:\n");
             printresults(num_global_tracefiles, libc_stats,
                          &global_libc_sum_stats);
+            if (cache_state == CACHE_ALL)
+                print_cache_states(num_global_tracefiles, libc_stats);
         }
     }
 
@@ -530,7 +1022,10 @@ int main(int argc, char **argv)
     /*
      * Get benchmark throughput
      */
-    double ref_throughput = measure_ref_throughput(checkpoint);
+    double ref_throughput =
+        builtin_ref ? measure_builtin_ref(num_global_tracefiles, tracedir,
+                                          global_tracefiles)
+                    : measure_ref_throughput(checkpoint);
 
     min_throughput = ref_throughput * (checkpoint ? MIN_SPEED_RATIO_CHECKPOINT
                                                   : MIN_SPEED_RATIO);
@@ -581,10 +1076,44 @@ int main(int argc, char **argv)
         {
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
+            if (cache_state == CACHE_ALL && !sparse_mode)
+                print_cache_states(num_global_tracefiles, mm_stats);
+            if (measure_interp && !sparse_mode)
+                print_interp_overhead(num_global_tracefiles, mm_stats);
+            if (calibrate && !sparse_mode)
+                print_calibration(num_global_tracefiles, mm_stats);
+            if (compare_hugepages && !sparse_mode)
+                print_hugepages(num_global_tracefiles, mm_stats);
+            if (window_first >= 0 && !sparse_mode)
+                print_window(num_global_tracefiles, mm_stats);
+            if (profile_mode)
+                print_profile(num_global_tracefiles, mm_stats);
+            if (rss_report)
+                print_rss(num_global_tracefiles, mm_stats);
+            if (touch_fraction > 0 && !sparse_mode)
+                print_app(num_global_tracefiles, mm_stats);
+            if (builtin_ref)
+                print_builtin_ref(num_global_tracefiles, mm_stats);
             printf("\n");
         }
     }
 
+    /* Optionally soak the mm package on one heap */
+    if (soak_rounds > 0 && !sparse_mode && !onetime_flag)
+        soak_test(num_global_tracefiles, tracedir, global_tracefiles, mm_stats);
+
+    /* Optionally compare several allocators on the same traces */
+    if (num_cmp_allocs > 0 && !onetime_flag)
+        compare_allocators(num_global_tracefiles, tracedir, global_tracefiles);
+
+    /* Optionally measure a thread-safe allocator on several threads */
+    if (num_threads > 0 && !onetime_flag)
+        thread_test(num_global_tracefiles, tracedir, global_tracefiles);
+
+    /* Optionally replay the traces on the threads they record */
+    if (recorded_mode != REC_NONE && !onetime_flag)
+        recorded_test(num_global_tracefiles, tracedir, global_tracefiles);
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc)
     {
@@ -593,6 +1122,8 @@ int main(int argc, char **argv)
                (float)global_mm_sum_stats.tput,
                (float)global_libc_sum_stats.tput,
                (float)(global_mm_sum_stats.tput / global_libc_sum_stats.tput));
+        if (compare_libc && !sparse_mode)
+            print_libc_comparison(num_global_tracefiles, mm_stats);
     }
 
     /* temporaries used to compute the performance index */
@@ -705,6 +1236,10 @@ int main(int argc, char **argv)
         {
             printf("Average throughput (Kops/sec) = %.0f.\n",
                    avg_mm_harm_throughput);
+            if (builtin_ref)
+                printf("Throughput ratio to the built-in reference = "
+                       "%.3f.\n",
+                       avg_mm_harm_throughput / ref_throughput);
             if (checkpoint)
             {
                 printf("Checkpoint Perf index = %.1f (util) + %.1f (thru) = "
@@ -768,9 +1303,9 @@ static void add_tracefile(char *trace)
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range set, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
@@ -779,8 +1314,7 @@ static void add_tracefile(char *trace)
 static range_set_t *new_range_set()
 {
     range_set_t *ranges = (range_set_t *)malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    ranges->tree = btree_new();
     return ranges;
 }
 
@@ -788,7 +1322,7 @@ static range_set_t *new_range_set()
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range record for this block and add it to the range set.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index)
@@ -820,9 +1354,9 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned)lo);
-    range_t *next = prev ? prev->next : NULL;
+    /* Look in the tree for the predecessor and successor blocks */
+    range_t *prev, *next;
+    btree_find_nearest(ranges->tree, lo, &prev, &next);
     /* See if it overlaps previous or next blocks */
     if (prev && lo <= prev->hi)
     {
@@ -840,43 +1374,19 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     }
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by adding a range record to the range set.
      */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->prev = prev;
-    if (prev)
-        prev->next = p;
-    else
-        ranges->list = p;
-    p->next = next;
-    if (next)
-        next->prev = p;
-    p->lo = lo;
-    p->hi = hi;
-    p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned)lo, (void *)p);
+    range_t r = {.lo = lo, .hi = hi, .index = index};
+    btree_insert(ranges->tree, &r);
     return true;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Remove the range record of block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p = (range_t *)tree_remove(ranges->lo_tree, (long unsigned)lo);
-    if (!p)
-        return;
-    range_t *prev = p->prev;
-    range_t *next = p->next;
-    if (prev)
-        prev->next = next;
-    else
-        ranges->list = next;
-    if (next)
-        next->prev = prev;
-    free(p);
+    btree_remove(ranges->tree, lo);
 }
 
 /*
@@ -884,7 +1394,7 @@ static void remove_range(range_set_t *ranges, char *lo)
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    btree_free(ranges->tree);
     free(ranges);
 }
 
@@ -906,6 +1416,47 @@ static void init_random_data(void)
     }
 }
 
+/*
+ * fill_random - In dense mode, copy n bytes of random data starting at
+ *     base into block.  The data wraps around at most once, since
+ *     maxfill is far smaller than RANDOM_DATA_LEN.
+ */
+static void fill_random(randint_t *block, size_t base, size_t n)
+{
+    size_t off = base % RANDOM_DATA_LEN;
+    size_t len;
+
+    while (n > 0)
+    {
+        len = n < RANDOM_DATA_LEN - off ? n : RANDOM_DATA_LEN - off;
+        memcpy(block, &random_data[off], len * sizeof(randint_t));
+        block += len;
+        n -= len;
+        off = 0;
+    }
+}
+
+/*
+ * match_random - In dense mode, return true if the n bytes in block
+ *     are the random data starting at base
+ */
+static bool match_random(const randint_t *block, size_t base, size_t n)
+{
+    size_t off = base % RANDOM_DATA_LEN;
+    size_t len;
+
+    while (n > 0)
+    {
+        len = n < RANDOM_DATA_LEN - off ? n : RANDOM_DATA_LEN - off;
+        if (memcmp(block, &random_data[off], len * sizeof(randint_t)) != 0)
+            return false;
+        block += len;
+        n -= len;
+        off = 0;
+    }
+    return true;
+}
+
 static void randomize_block(trace_t *traces, int index)
 {
     size_t size, fsize;
@@ -927,16 +1478,18 @@ static void randomize_block(trace_t *traces, int index)
         fsize = maxfill;
     base = traces->block_rand_base[index];
 
-    // NOTE: It's expensive to do this one byte at a time.
-
     // NOTE: It would be nice to also fill in at end of block, but
     // this gets messy with REALLOC
 
-    for (i = 0; i < fsize; i++)
-    {
-        mem_write(&block[i], random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
+    /* Emulated memory has to be written one byte at a time */
+    if (!sparse_mode)
+        fill_random(block, base, fsize);
+    else
+        for (i = 0; i < fsize; i++)
+        {
+            mem_write(&block[i], random_data[(base + i) % RANDOM_DATA_LEN],
+                      sizeof(randint_t));
+        }
 
 #ifdef USE_MSAN
     /* Mark payload data as uninitialized */
@@ -975,7 +1528,10 @@ static bool check_index(const trace_t *trace, int opnum, int index)
     __msan_unpoison(trace->blocks[index], trace->block_sizes[index]);
 #endif
 
-    // NOTE: It's expensive to do this one byte at a time.
+    /* In dense mode, only count the garbled bytes if there are any */
+    if (!sparse_mode && match_random(block, base, fsize))
+        return true;
+
     setUBCheck(false);
     for (i = 0; i < fsize; i++)
     {
@@ -1019,6 +1575,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     int max_index = 0;
     int op_index;
     int ignore = 0;
+    uint64_t *thread_time = NULL; /* latest time seen on each thread */
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -1034,7 +1591,20 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
+    /* A version 2 trace starts with a line "v2 <num_threads>" */
     int iweight;
+    trace->version = 1;
+    trace->num_threads = 1;
+    if (fscanf(tracefile, " v%d", &trace->version) == 1)
+    {
+        if (trace->version != 2)
+            app_error("%s: unknown trace version %d\n", trace->filename,
+                      trace->version);
+        ignore += fscanf(tracefile, "%d", &trace->num_threads);
+        if (trace->num_threads < 1 || trace->num_threads > MAX_TRACE_THREADS)
+            app_error("%s: bad number of threads (%d)\n", trace->filename,
+                      trace->num_threads);
+    }
     ignore += fscanf(tracefile, "%d", &iweight);
     trace->weight = iweight;
     ignore += fscanf(tracefile, "%d", &trace->num_ids);
@@ -1045,16 +1615,34 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
     }
+    if (trace->num_ids < 0 || trace->num_ids > OP_MAX_INDEX)
+    {
+        app_error("%s: too many request ids (%d)", trace->filename,
+                  trace->num_ids);
+    }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+    /*
+     * We'll store each request line in the trace in these arrays,
+     * followed by PREFETCH_DIST free(NULL) requests that are never
+     * executed but can be prefetched from.
+     */
+    if ((trace->ops = (traceop_t *)malloc(
+             (trace->num_ops + PREFETCH_DIST) * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
+    if ((trace->sizes = (size_t *)calloc(trace->num_ops + PREFETCH_DIST,
+                                         sizeof(size_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+    for (op_index = 0; op_index < PREFETCH_DIST; op_index++)
+        trace->ops[trace->num_ops + op_index] = OP_PACK(FREE, -1);
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
-        NULL)
+    /*
+     * We'll keep an array of pointers to the allocated blocks here,
+     * with one extra NULL slot in front of it for free(NULL)...
+     */
+    if ((trace->blocks = (char **)calloc(trace->num_ids + 1,
+                                         sizeof(char *))) == NULL)
         unix_error("malloc 3 failed in read_trace");
+    trace->blocks++;
 
     /* ... along with the corresponding byte sizes of each block */
     if ((trace->block_sizes =
@@ -1066,6 +1654,18 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* Version 2 records the thread and time of each request */
+    trace->tids = NULL;
+    trace->times = NULL;
+    trace->time_lo = UINT64_MAX;
+    trace->time_hi = 0;
+    if (trace->version > 1 &&
+        ((trace->tids = calloc(trace->num_ops, sizeof(uint16_t))) == NULL ||
+         (trace->times = calloc(trace->num_ops, sizeof(uint64_t))) == NULL ||
+         (thread_time = calloc(trace->num_threads, sizeof(uint64_t))) ==
+             NULL))
+        unix_error("malloc 6 failed in read_trace");
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
@@ -1075,32 +1675,53 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         {
         case 'a':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
+            trace->ops[op_index] = OP_PACK(ALLOC, index);
+            trace->sizes[op_index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
+            trace->ops[op_index] = OP_PACK(REALLOC, index);
+            trace->sizes[op_index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
             ignore += fscanf(tracefile, "%u", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
+            trace->ops[op_index] = OP_PACK(FREE, index);
             break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
         }
+        if (trace->version > 1)
+        {
+            int tid;
+            uint64_t t;
+
+            ignore += fscanf(tracefile, "%d %" SCNu64, &tid,
+                             &trace->times[op_index]);
+            if (tid < 0 || tid >= trace->num_threads)
+                app_error("%s: thread %d out of range at line %d\n",
+                          trace->filename, tid, LINENUM(trace, op_index));
+            trace->tids[op_index] = (uint16_t)tid;
+
+            /* Each thread's requests must be in time order */
+            t = trace->times[op_index];
+            if (t < thread_time[tid])
+                app_error("%s: time goes back on thread %d at line %d\n",
+                          trace->filename, tid, LINENUM(trace, op_index));
+            thread_time[tid] = t;
+            if (t < trace->time_lo)
+                trace->time_lo = t;
+            if (t > trace->time_hi)
+                trace->time_hi = t;
+        }
         op_index++;
         if (op_index == trace->num_ops)
             break;
     }
     fclose(tracefile);
+    free(thread_time);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
@@ -1123,15 +1744,18 @@ static void reinit_trace(trace_t *trace)
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record and the arrays it points to, all
+ *              of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
-    free(trace->blocks);
+    free(trace->ops); /* free the five arrays... */
+    free(trace->sizes);
+    free(trace->blocks - 1);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->tids); /* and those of version 2 */
+    free(trace->times);
     free(trace); /* and the trace record itself... */
 }
 
@@ -1153,7 +1777,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     char *p;
     bool allCheck = true;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range set */
     mem_reset_brk();
     reinit_trace(trace);
 
@@ -1167,12 +1791,13 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++)
     {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        index = OP_INDEX(trace->ops[i]);
+        size = trace->sizes[i];
 
         if (debug_mode == DBG_EXPENSIVE)
         {
             range_t *r;
+            biter_t it;
 
             /* Let the students check their own heap */
             if (!mm_checkheap(0))
@@ -1182,18 +1807,16 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r)
+            for (r = btree_first(ranges->tree, &it); r; r = btree_next(&it))
             {
                 if (!check_index(trace, i, r->index))
                 {
                     allCheck = false;
                 }
-                r = r->next;
             }
         }
 
-        switch (trace->ops[i].type)
+        switch (OP_TYPE(trace->ops[i]))
         {
 
         case ALLOC: /* mm_malloc */
@@ -1207,7 +1830,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range set if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
@@ -1245,10 +1868,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 return false;
             }
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range set */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range set */
             if (size > 0)
             {
                 if (add_range(ranges, newp, size, trace, i, index) == 0)
@@ -1302,6 +1925,171 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     return allCheck;
 }
 
+/*
+ * open_timeline - Create the heap timeline file for a trace: the trace's
+ *    name with .rep replaced by .csv, in the current directory.  The
+ *    header is written by the first timeline_row.
+ */
+static FILE *open_timeline(const trace_t *trace)
+{
+    char name[MAXLINE + 4];
+    const char *base = strrchr(trace->filename, '/');
+    char *ext;
+    FILE *fp;
+
+    base = base ? base + 1 : trace->filename;
+    strcpy(name, base);
+    if ((ext = strrchr(name, '.')) != NULL && strcmp(ext, ".rep") == 0)
+        *ext = '\0';
+    strcat(name, ".csv");
+    if ((fp = fopen(name, "w")) == NULL)
+        unix_error("Could not open timeline file %s", name);
+    if (verbose > 1)
+        printf("Writing heap timeline to %s\n", name);
+    return fp;
+}
+
+/*
+ * timeline_row - Write one sample of the heap timeline after op ops of
+ *    the trace: the live payload bytes, the heap size, the number of
+ *    mem_sbrk calls so far, and, if the allocator reports them, the
+ *    largest free block and the free bytes on each of its free lists.
+ *    Op 0, the state right after mm_init, comes first, with the header.
+ */
+static void timeline_row(FILE *fp, int op, size_t live_bytes)
+{
+    size_t bytes[MAX_FREE_LISTS], largest = 0;
+    int j, num_lists = 0;
+
+    if (mm_free_list_bytes)
+        num_lists = mm_free_list_bytes(bytes, &largest, MAX_FREE_LISTS);
+    if (op == 0)
+    {
+        fprintf(fp, "op,live_bytes,heap_bytes,sbrk_calls");
+        if (mm_free_list_bytes)
+            fprintf(fp, ",largest_free");
+        for (j = 0; j < num_lists; j++)
+            fprintf(fp, ",free_bytes_%d", j);
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "%d,%zu,%zu,%zu", op, live_bytes, mem_heapsize(),
+            mem_sbrk_calls());
+    if (mm_free_list_bytes)
+        fprintf(fp, ",%zu", largest);
+    for (j = 0; j < num_lists; j++)
+        fprintf(fp, ",%zu", bytes[j]);
+    fprintf(fp, "\n");
+}
+
+/*
+ * peak_op - Returns the request after which the trace has the most
+ *    payload allocated, the last one if the peak is reached more than
+ *    once.
+ */
+static int peak_op(const trace_t *trace)
+{
+    int i, index, peak = 0;
+    size_t total = 0, max_total = 0;
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+
+    if (sizes == NULL)
+        unix_error("sizes calloc in peak_op failed");
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        if ((index = OP_INDEX(trace->ops[i])) < 0)
+            continue;
+        total -= sizes[index];
+        sizes[index] = OP_TYPE(trace->ops[i]) == FREE ? 0 : trace->sizes[i];
+        total += sizes[index];
+        if (total >= max_total)
+        {
+            max_total = total;
+            peak = i;
+        }
+    }
+    free(sizes);
+    return peak;
+}
+
+/* The live payloads, sorted by address, while walking the heap */
+typedef struct
+{
+    frag_t *frag;
+    range_t *live;
+    int num_live;
+    size_t walked; /* bytes in the blocks visited so far */
+} frag_walk_t;
+
+static int compare_range(const void *a, const void *b)
+{
+    const range_t *x = a, *y = b;
+    return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+/* Attribute the bytes of one block, for mm_walk_heap */
+static void frag_visit(void *payload, size_t size, size_t usable, bool alloc,
+                       void *arg)
+{
+    frag_walk_t *walk = arg;
+    frag_t *frag = walk->frag;
+    range_t key = {.lo = payload}, *r;
+    int j;
+
+    walk->walked += size;
+    if (!alloc)
+    {
+        for (j = 0; size > frag_bin_max[j]; j++)
+            ;
+        frag->free_bytes[j] += size;
+        return;
+    }
+    frag->overhead += size - usable;
+    r = bsearch(&key, walk->live, walk->num_live, sizeof(range_t),
+                compare_range);
+    if (r != NULL)
+    {
+        frag->payload += r->hi - r->lo;
+        frag->padding += usable - (size_t)(r->hi - r->lo);
+    }
+    else
+        frag->padding += usable;
+}
+
+/*
+ * measure_frag - Break the heap down into the payload requested by the
+ *    trace, the allocator's overhead, the padding it added to requests,
+ *    and free blocks by size, by walking it with mm_walk_heap.  The
+ *    driver's own record of the live blocks gives the requested sizes.
+ *    Heap bytes outside every block, such as the prologue and epilogue,
+ *    count as overhead.
+ */
+static void measure_frag(trace_t *trace, frag_t *frag)
+{
+    frag_walk_t walk = {.frag = frag, .num_live = 0, .walked = 0};
+    int i;
+
+    memset(frag, 0, sizeof(*frag));
+    frag->heap = mem_heapsize();
+    if (!mm_walk_heap)
+        return;
+    if ((walk.live = malloc(trace->num_ids * sizeof(range_t))) == NULL)
+        unix_error("live malloc in measure_frag failed");
+    for (i = 0; i < trace->num_ids; i++)
+    {
+        if (trace->blocks[i] == NULL)
+            continue;
+        walk.live[walk.num_live].lo = trace->blocks[i];
+        walk.live[walk.num_live].hi = trace->blocks[i] + trace->block_sizes[i];
+        walk.live[walk.num_live].index = i;
+        walk.num_live++;
+    }
+    qsort(walk.live, walk.num_live, sizeof(range_t), compare_range);
+    mm_walk_heap(frag_visit, &walk);
+    free(walk.live);
+    if (frag->heap > walk.walked)
+        frag->overhead += frag->heap - walk.walked;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
@@ -1314,9 +2102,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, FILE *timeline,
+                           stats_t *stats)
 {
-    int i;
+    int i, peak = frag_report || rss_report ? peak_op(trace) : -1;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
@@ -1327,18 +2116,24 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
+    if (rss_report)
+        /* Start with no pages resident, as a fresh process would */
+        mem_release_heap();
+    else
+        mem_reset_brk();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    if (timeline)
+        timeline_row(timeline, 0, 0);
 
     for (i = 0; i < trace->num_ops; i++)
     {
-        switch (trace->ops[i].type)
+        switch (OP_TYPE(trace->ops[i]))
         {
 
         case ALLOC: /* mm_alloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = OP_INDEX(trace->ops[i]);
+            size = trace->sizes[i];
 
             if ((p = mm_malloc(size)) == NULL)
             {
@@ -1354,8 +2149,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = OP_INDEX(trace->ops[i]);
+            newsize = trace->sizes[i];
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
@@ -1375,7 +2170,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = OP_INDEX(trace->ops[i]);
             if (index < 0)
             {
                 size = 0;
@@ -1389,6 +2184,13 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
             mm_free(p);
 
+            /* Forget the block, so measure_frag sees only live ones */
+            if (index >= 0)
+            {
+                trace->blocks[index] = NULL;
+                trace->block_sizes[index] = 0;
+            }
+
             total_size -= size;
             break;
 
@@ -1400,6 +2202,28 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
+
+        if (timeline && ((i + 1) % timeline_interval == 0 ||
+                         i + 1 == trace->num_ops))
+            timeline_row(timeline, i + 1, total_size);
+        if (i == peak && frag_report)
+            measure_frag(trace, &stats->frag_peak);
+        if (i == peak && rss_report)
+        {
+            stats->heap_peak = mem_heapsize();
+            rss_written_known &=
+                mem_heap_residency(&stats->rss_peak, &stats->written_peak);
+        }
+    }
+    if (frag_report)
+        measure_frag(trace, &stats->frag_end);
+    if (rss_report)
+    {
+        rss_written_known &=
+            mem_heap_residency(&stats->rss_end, &stats->written_end);
+        stats->rss_util = stats->rss_peak > 0 ? (double)max_total_size /
+                                                    (double)stats->rss_peak
+                                              : 0.0;
     }
 
 #if !REF_ONLY
@@ -1410,62 +2234,1718 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * replay_speed - Interpret trace requests [first, last) with the given
+ *    allocator.  This is the timed loop shared by the xxx_speed
+ *    functions; it is always inlined so each caller gets direct calls.
+ *    The loop keeps the trace in locals, prefetches the block slot of a
+ *    later request, and frees through blocks[-1] for free(NULL).
  */
-static void eval_mm_speed(void *ptr)
+static inline __attribute__((always_inline)) void
+replay_speed(trace_t *trace, int first, int last, void *(*alloc_fn)(size_t),
+             void *(*realloc_fn)(void *, size_t), void (*free_fn)(void *),
+             const char *who)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
-
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (!mm_init())
-        app_error("mm_init failed in eval_mm_speed");
+    int i;
+    traceop_t op;
+    char *p;
+    const traceop_t *ops = trace->ops;
+    const size_t *sizes = trace->sizes;
+    char **blocks = trace->blocks;
 
-    /* Interpret each trace request */
-    for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type)
+    for (i = first; i < last; i++)
+    {
+        op = ops[i];
+        __builtin_prefetch(&blocks[OP_INDEX(ops[i + PREFETCH_DIST])], 1);
+        switch (OP_TYPE(op))
         {
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+        case ALLOC: /* malloc */
+            if ((p = alloc_fn(sizes[i])) == NULL)
+                app_error("%s malloc error in replay\n", who);
+            blocks[OP_INDEX(op)] = p;
             break;
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
+        case REALLOC: /* realloc */
+            if ((p = realloc_fn(blocks[OP_INDEX(op)], sizes[i])) == NULL &&
+                sizes[i] != 0)
+                app_error("%s realloc error in replay\n", who);
+            blocks[OP_INDEX(op)] = p;
             break;
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index < 0)
+        case FREE: /* free */
+            free_fn(blocks[OP_INDEX(op)]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in replay\n");
+        }
+    }
+}
+
+/*
+ * mm_realloc_unchecked - mm_realloc without the UB checks, which would
+ *    otherwise flag the copy out of the old block.
+ */
+static void *mm_realloc_unchecked(void *ptr, size_t size)
+{
+    void *newp;
+
+    setUBCheck(false);
+    newp = mm_realloc(ptr, size);
+    setUBCheck(true);
+    return newp;
+}
+
+/*
+ * The access profile (-M) runs each access through models of an L1 and
+ * L2 cache and a TLB that persist across requests, and counts the
+ * distinct lines and pages each request touches.
+ */
+static cache_t *prof_l1, *prof_l2, *prof_tlb;
+static lineset_t *prof_lines, *prof_pages;
+static prof_t *prof_cur; /* counts for the kind of the current request */
+
+/* Account for one emulated access, for mem_set_profiler */
+static void profile_access(const void *addr, size_t len,
+                           bool write __attribute__((unused)))
+{
+    uintptr_t lo = (uintptr_t)addr, hi = lo + len - 1, n;
+
+    prof_cur->accesses++;
+    for (n = lo / PROF_LINE_SIZE; n <= hi / PROF_LINE_SIZE; n++)
+    {
+        prof_cur->line_refs++;
+        if (cache_access(prof_l1, n * PROF_LINE_SIZE))
+            prof_cur->l1_hits++;
+        else if (cache_access(prof_l2, n * PROF_LINE_SIZE))
+            prof_cur->l2_hits++;
+        if (lineset_add(prof_lines, n))
+            prof_cur->lines++;
+    }
+    for (n = lo / PROF_PAGE_SIZE; n <= hi / PROF_PAGE_SIZE; n++)
+    {
+        prof_cur->page_refs++;
+        if (cache_access(prof_tlb, n * PROF_PAGE_SIZE))
+            prof_cur->tlb_hits++;
+        if (lineset_add(prof_pages, n))
+            prof_cur->pages++;
+    }
+}
+
+/* Close the profile of the current request */
+static void profile_end_request(void)
+{
+    prof_cur->ops++;
+    lineset_clear(prof_lines);
+    lineset_clear(prof_pages);
+}
+
+/*
+ * eval_mm_profile - Replay the trace with every emulated heap access
+ *    reported to profile_access, and attribute the accesses to the kind
+ *    of request that made them.  The caches and TLB start empty.
+ */
+static void eval_mm_profile(trace_t *trace, prof_t *prof)
+{
+    int i;
+    traceop_t op;
+    char *p;
+
+    prof_l1 = cache_new(PROF_L1_BYTES, PROF_L1_WAYS, PROF_LINE_SIZE);
+    prof_l2 = cache_new(PROF_L2_BYTES, PROF_L2_WAYS, PROF_LINE_SIZE);
+    prof_tlb = cache_new(PROF_TLB_ENTRIES * PROF_PAGE_SIZE, PROF_TLB_WAYS,
+                         PROF_PAGE_SIZE);
+    prof_lines = lineset_new();
+    prof_pages = lineset_new();
+    memset(prof, 0, NUM_PROF_KINDS * sizeof(prof_t));
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    mem_set_profiler(profile_access);
+
+    prof_cur = &prof[PROF_INIT];
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_profile");
+    profile_end_request();
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        op = trace->ops[i];
+        prof_cur = &prof[PROF_MALLOC + OP_TYPE(op)];
+        switch (OP_TYPE(op))
+        {
+        case ALLOC:
+            if ((p = mm_malloc(trace->sizes[i])) == NULL)
+                app_error("mm malloc error in eval_mm_profile\n");
+            trace->blocks[OP_INDEX(op)] = p;
+            break;
+
+        case REALLOC:
+            if ((p = mm_realloc_unchecked(trace->blocks[OP_INDEX(op)],
+                                          trace->sizes[i])) == NULL &&
+                trace->sizes[i] != 0)
+                app_error("mm realloc error in eval_mm_profile\n");
+            trace->blocks[OP_INDEX(op)] = p;
+            break;
+
+        case FREE:
+            mm_free(trace->blocks[OP_INDEX(op)]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_profile\n");
+        }
+        profile_end_request();
+    }
+
+    mem_set_profiler(NULL);
+    cache_free(prof_l1);
+    cache_free(prof_l2);
+    cache_free(prof_tlb);
+    lineset_free(prof_lines);
+    lineset_free(prof_pages);
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_speed");
+
+    replay_speed(trace, 0, trace->num_ops, mm_malloc, mm_realloc_unchecked,
+                 mm_free, "mm");
+}
+
+/*
+ * eval_mm_window - This is the function that is used by fsec_forked()
+ *    to time a window of the trace.  It runs in a copy of the driver
+ *    taken after the requests before the window, and replays only the
+ *    window.
+ */
+static void eval_mm_window(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+
+    replay_speed(params->trace, params->first, params->last, mm_malloc,
+                 mm_realloc_unchecked, mm_free, "mm");
+}
+
+/* Write every page of [lo, lo + bytes) back to itself */
+static void touch_pages(void *lo, size_t bytes)
+{
+    volatile char *p = lo;
+    size_t off, page = mem_pagesize();
+
+    for (off = 0; off < bytes; off += page)
+        p[off] = p[off];
+}
+
+/*
+ * touch_snapshot - Give the forked copy of the driver its own copy of
+ *    the heap and the block array before the window is timed, so the
+ *    copy-on-write faults are not counted against the allocator.
+ */
+static void touch_snapshot(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+    trace_t *trace = params->trace;
+
+    touch_pages(mem_heap_lo(), params->touch_bytes);
+    touch_pages(trace->blocks - 1, (trace->num_ids + 1) * sizeof(char *));
+}
+
+/*
+ * The application replay (-a) stands in for a program that uses its
+ * memory: it reads and writes one byte per TOUCH_STRIDE in the first
+ * touch_fraction of each payload when the block is allocated and again
+ * before it is freed, and spins for think_iters steps between requests.
+ */
+static uint64_t think_sink; /* keeps the busywork from being optimized out */
+
+static inline void touch_payload(char *p, size_t size)
+{
+    size_t off, n = (size_t)ceil(size * touch_fraction);
+
+    for (off = 0; off < n; off += TOUCH_STRIDE)
+        p[off]++;
+}
+
+static inline void think(void)
+{
+    uint64_t x = think_sink;
+    int i;
+
+    /* A chain of dependent multiplies, which no cache miss can shorten */
+    for (i = 0; i < think_iters; i++)
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    think_sink = x;
+}
+
+/*
+ * eval_app_speed - This is the function that is used by fcyc() to time
+ *    the application replay of the mm malloc package.
+ */
+static void eval_app_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    const traceop_t *ops = trace->ops;
+    const size_t *sizes = trace->sizes;
+    char **blocks = trace->blocks;
+    size_t *block_sizes = trace->block_sizes;
+    int i, index;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_app_speed");
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = OP_INDEX(ops[i]);
+        switch (OP_TYPE(ops[i]))
+        {
+        case ALLOC:
+            if ((p = mm_malloc(sizes[i])) == NULL)
+                app_error("mm malloc error in eval_app_speed\n");
+            touch_payload(p, sizes[i]);
+            blocks[index] = p;
+            block_sizes[index] = sizes[i];
+            break;
+
+        case REALLOC:
+            if ((p = mm_realloc_unchecked(blocks[index], sizes[i])) == NULL &&
+                sizes[i] != 0)
+                app_error("mm realloc error in eval_app_speed\n");
+            if (p != NULL)
+                touch_payload(p, sizes[i]);
+            blocks[index] = p;
+            block_sizes[index] = sizes[i];
+            break;
+
+        case FREE:
+            if (index >= 0 && blocks[index] != NULL)
+                touch_payload(blocks[index], block_sizes[index]);
+            mm_free(blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_app_speed\n");
+        }
+        think();
+    }
+}
+
+static int compare_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_locality - Replay the trace, untimed, and measure how close
+ *    together the mm package places blocks: the median distance between
+ *    the payloads of consecutive mallocs, the fraction of them less than
+ *    a page apart, and, when the most payload is live, the span of
+ *    addresses the live blocks cover relative to their payload.
+ */
+static void eval_locality(trace_t *trace, stats_t *stats)
+{
+    int i, index, num_dists = 0, near = 0, peak = peak_op(trace);
+    size_t *dists = malloc(trace->num_ops * sizeof(size_t));
+    size_t page = mem_pagesize(), live_bytes = 0;
+    char *p, *prev = NULL, *lo, *hi;
+
+    if (dists == NULL)
+        unix_error("dists malloc in eval_locality failed");
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_locality");
+
+    stats->live_span = 0.0;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = OP_INDEX(trace->ops[i]);
+        switch (OP_TYPE(trace->ops[i]))
+        {
+        case ALLOC:
+            if ((p = mm_malloc(trace->sizes[i])) == NULL)
+                app_error("mm malloc error in eval_locality\n");
+            if (prev != NULL)
+            {
+                dists[num_dists] = p > prev ? p - prev : prev - p;
+                near += dists[num_dists++] < page;
+            }
+            prev = p;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->sizes[i];
+            break;
+
+        case REALLOC:
+            p = mm_realloc_unchecked(trace->blocks[index], trace->sizes[i]);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = p ? trace->sizes[i] : 0;
+            break;
+
+        case FREE:
+            mm_free(trace->blocks[index]);
+            if (index >= 0)
+            {
+                trace->blocks[index] = NULL;
+                trace->block_sizes[index] = 0;
+            }
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_locality\n");
+        }
+
+        if (i == peak)
+        {
+            lo = hi = NULL;
+            for (index = 0; index < trace->num_ids; index++)
+            {
+                if ((p = trace->blocks[index]) == NULL)
+                    continue;
+                if (lo == NULL || p < lo)
+                    lo = p;
+                if (hi == NULL || p + trace->block_sizes[index] > hi)
+                    hi = p + trace->block_sizes[index];
+                live_bytes += trace->block_sizes[index];
+            }
+            if (live_bytes > 0)
+                stats->live_span = (double)(hi - lo) / (double)live_bytes;
+        }
+    }
+
+    stats->alloc_dist = 0.0;
+    stats->near_allocs = 0.0;
+    if (num_dists > 0)
+    {
+        qsort(dists, num_dists, sizeof(size_t), compare_size);
+        stats->alloc_dist = (double)dists[num_dists / 2];
+        stats->near_allocs = (double)near / num_dists;
+    }
+    free(dists);
+}
+
+/*
+ * The bump allocator is a stub with the least work an allocator can do:
+ * it hands out consecutive aligned chunks of the heap and never reuses
+ * them.  The speed replay never touches payloads, so when the heap is
+ * full it simply starts over at the bottom.
+ */
+static char *bump_ptr; /* next free byte */
+static char *bump_end; /* end of the space obtained from mem_sbrk */
+
+static void *bump_malloc(size_t size)
+{
+    char *p;
+    size_t chunk;
+
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if (size > (size_t)(bump_end - bump_ptr))
+    {
+        chunk = size > BUMP_CHUNK ? size : BUMP_CHUNK;
+        if (mem_heapsize() + chunk > MAX_DENSE_HEAP)
+            mem_reset_brk();
+        if ((p = mem_sbrk(chunk)) == (void *)-1)
+            return NULL;
+        if (p != bump_end)
+            bump_ptr = p;
+        bump_end = p + chunk;
+    }
+    p = bump_ptr;
+    bump_ptr += size;
+    return p;
+}
+
+static void *bump_realloc(void *ptr __attribute__((unused)), size_t size)
+{
+    return size == 0 ? NULL : bump_malloc(size);
+}
+
+static void bump_free(void *ptr __attribute__((unused)))
+{
+}
+
+/*
+ * eval_bump_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the bump allocator stub.  It does the
+ *    same bookkeeping, heap reset and replay as eval_mm_speed, so the
+ *    difference between the two is the time spent in the mm package.
+ */
+static void eval_bump_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    reinit_trace(trace);
+
+    /* Reset the heap and the bump pointer */
+    mem_reset_brk();
+    bump_ptr = bump_end = NULL;
+
+    replay_speed(trace, 0, trace->num_ops, bump_malloc, bump_realloc,
+                 bump_free, "bump");
+}
+
+/*
+ * The built-in reference allocator (-N) is simple segregated storage:
+ * each block is a power of two bytes, at least REF_ALLOC_MIN, with its
+ * size class in a header, and freed blocks go on a LIFO list for their
+ * class, never to be split or coalesced.  Every block comes straight
+ * from mem_sbrk.  It is small and fixed, so its throughput is the same
+ * workload on every machine, and the driver scores relative to it.
+ */
+#define REF_ALLOC_HDR ALIGNMENT /* header bytes, holding the size class */
+#define REF_ALLOC_MIN 32        /* smallest block, class 0 */
+#define REF_ALLOC_CLASSES 48    /* blocks of up to REF_ALLOC_MIN << 47 */
+#define REF_ALLOC_BLOCK(c) ((size_t)REF_ALLOC_MIN << (c))
+
+static char *ref_lists[REF_ALLOC_CLASSES]; /* free payloads, by class */
+
+/* Smallest class whose blocks hold size bytes of payload */
+static size_t ref_class(size_t size)
+{
+    size_t block = size + REF_ALLOC_HDR;
+
+    if (block <= REF_ALLOC_MIN)
+        return 0;
+    return (size_t)(64 - __builtin_clzl(block - 1)) -
+           (size_t)__builtin_ctzl(REF_ALLOC_MIN);
+}
+
+static bool ref_start(void)
+{
+    mem_reset_brk();
+    memset(ref_lists, 0, sizeof(ref_lists));
+    return true;
+}
+
+static void *ref_malloc(size_t size)
+{
+    size_t c = ref_class(size);
+    char *p;
+
+    if (c >= REF_ALLOC_CLASSES)
+        return NULL;
+    if ((p = ref_lists[c]) != NULL)
+    {
+        ref_lists[c] = *(char **)p;
+        return p;
+    }
+    if ((p = mem_sbrk((intptr_t)REF_ALLOC_BLOCK(c))) == (void *)-1)
+        return NULL;
+    *(size_t *)p = c;
+    return p + REF_ALLOC_HDR;
+}
+
+static void ref_free(void *ptr)
+{
+    size_t c;
+
+    if (ptr == NULL)
+        return;
+    c = *(size_t *)((char *)ptr - REF_ALLOC_HDR);
+    *(char **)ptr = ref_lists[c];
+    ref_lists[c] = ptr;
+}
+
+static void *ref_realloc(void *ptr, size_t size)
+{
+    size_t c;
+    char *newp;
+
+    if (ptr == NULL)
+        return ref_malloc(size);
+    if (size == 0)
+    {
+        ref_free(ptr);
+        return NULL;
+    }
+    c = *(size_t *)((char *)ptr - REF_ALLOC_HDR);
+    if (size <= REF_ALLOC_BLOCK(c) - REF_ALLOC_HDR)
+        return ptr;
+    if ((newp = ref_malloc(size)) == NULL)
+        return NULL;
+    memcpy(newp, ptr, REF_ALLOC_BLOCK(c) - REF_ALLOC_HDR);
+    ref_free(ptr);
+    return newp;
+}
+
+/*
+ * eval_ref_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the built-in reference allocator.
+ */
+static void eval_ref_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    reinit_trace(trace);
+    ref_start();
+
+    replay_speed(trace, 0, trace->num_ops, ref_malloc, ref_realloc, ref_free,
+                 "ref");
+}
+
+/*
+ * set_cache_state - Configure fcyc to evict the caches before each
+ *    replay as required by the given cache state.
+ */
+static void set_cache_state(cache_state_t state)
+{
+    long bytes;
+
+    switch (state)
+    {
+    case CACHE_WARM:
+        if ((bytes = fcyc_cache_bytes(2)) == 0)
+            bytes = DEFAULT_L2_BYTES;
+        set_fcyc_clear_cache(1);
+        set_fcyc_cache_size(EVICT_FACTOR * bytes);
+        set_fcyc_flush_tlb(0);
+        break;
+    case CACHE_COLD:
+        if ((bytes = fcyc_cache_bytes(0)) == 0)
+            bytes = DEFAULT_LLC_BYTES;
+        set_fcyc_clear_cache(1);
+        set_fcyc_cache_size(EVICT_FACTOR * bytes);
+        set_fcyc_flush_tlb(flush_tlb ? TLB_FLUSH_BYTES : 0);
+        break;
+    default:
+        bytes = 0;
+        set_fcyc_clear_cache(0);
+        set_fcyc_flush_tlb(0);
+        break;
+    }
+    if (verbose > 1)
+        printf("Cache state %s: evicting %ld KB%s before each replay\n",
+               cache_state_names[state], EVICT_FACTOR * bytes / 1024,
+               state == CACHE_COLD && flush_tlb ? " and the TLB" : "");
+}
+
+/*
+ * measure_once - Time one of the xxx_speed functions in the current
+ *    cache state, either with the K-best scheme or, in robust benchmark
+ *    mode, as a median with a bootstrap confidence interval.
+ */
+static void measure_once(test_funct f, speed_t *params, stats_t *stats)
+{
+    fstats_t fstats;
+
+    if (bench_samples == 0)
+    {
+        stats->secs = fsec(f, params);
+        return;
+    }
+    stats->secs = fsec_robust(f, params, &fstats);
+    stats->secs_lo = fstats.ci_lo;
+    stats->secs_hi = fstats.ci_hi;
+    if (verbose > 1)
+        printf("%ld samples, %ld outliers rejected\n", fstats.samples,
+               fstats.outliers);
+}
+
+/*
+ * count_tlb_misses - Count the dTLB misses of one call to f, after an
+ *    uncounted call that faults in the heap.  Returns -1 when the
+ *    hardware counters are not available.
+ */
+static double count_tlb_misses(test_funct f, speed_t *params)
+{
+    f(params);
+    if (!start_tlb_counter())
+        return -1;
+    f(params);
+    return get_tlb_counter();
+}
+
+/*
+ * measure_window - Time requests [window_first, window_last) of the
+ *    trace.  The requests before the window are replayed once, untimed,
+ *    and every sample then forks from that state, so the window is
+ *    always replayed on the same heap however often it is timed.  A
+ *    window that starts past the end of the trace is not timed.
+ */
+static void measure_window(speed_t *params, stats_t *stats)
+{
+    fstats_t fstats;
+    trace_t *trace = params->trace;
+
+    params->last = window_last;
+    if (params->last < 0 || params->last > trace->num_ops)
+        params->last = trace->num_ops;
+    params->first = window_first < params->last ? window_first : params->last;
+    stats->window_first = params->first;
+    stats->window_last = params->last;
+    stats->window_ops = params->last - params->first;
+    if (stats->window_ops == 0)
+    {
+        printf("Warning: -w window starts at request %d, past the end of "
+               "%s (%d requests); not timed\n",
+               window_first, trace->filename, trace->num_ops);
+        return;
+    }
+    /* The full replays have just left the heap at its peak size */
+    params->touch_bytes = mem_heapsize();
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in measure_window");
+    replay_speed(trace, 0, params->first, mm_malloc, mm_realloc_unchecked,
+                 mm_free, "mm");
+
+    stats->window_secs =
+        fsec_forked(touch_snapshot, eval_mm_window, params, &fstats);
+    stats->window_lo = fstats.ci_lo;
+    stats->window_hi = fstats.ci_hi;
+}
+
+/*
+ * free_outstanding - Free the blocks that a replay of the trace left
+ *    allocated, with free_fn.
+ */
+static void free_outstanding(trace_t *trace, void (*free_fn)(void *))
+{
+    int i, index;
+    traceop_t op;
+    bool *live = calloc(trace->num_ids, sizeof(bool));
+
+    if (live == NULL)
+        unix_error("live calloc in free_outstanding failed");
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        op = trace->ops[i];
+        if ((index = OP_INDEX(op)) >= 0)
+            live[index] = OP_TYPE(op) != FREE;
+    }
+    for (i = 0; i < trace->num_ids; i++)
+    {
+        if (live[i])
+            free_fn(trace->blocks[i]);
+    }
+    free(live);
+}
+
+/*
+ * soak_test - Replay the valid traces in rotation, soak_rounds times,
+ *    on one heap that is never reset.  The blocks each trace leaves
+ *    allocated are freed after it, so every round asks for the same
+ *    memory, but the allocator keeps whatever fragmentation the earlier
+ *    rounds left behind.  The free lists are counted at the end of the
+ *    last trace of each round.  A line is printed as each round ends, so
+ *    a run that runs out of heap still shows the drift up to that point.
+ */
+static void soak_test(int num_tracefiles, const char *tracedir,
+                      char **tracefiles, const stats_t *mm_stats)
+{
+    int i, r, num = 0, num_lists = 0;
+    size_t j, peak_bytes = 0, free_blocks, longest;
+    size_t lengths[MAX_FREE_LISTS];
+    double secs, ops, heap = 0, tput = 0, first_tput = 0, first_heap = 0;
+    stats_t scratch;
+    trace_t **traces = calloc(num_tracefiles, sizeof(trace_t *));
+
+    if (traces == NULL)
+        unix_error("traces calloc in soak_test failed");
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        if (!mm_stats[i].valid)
+            continue;
+        traces[num] = read_trace(&scratch, tracedir, tracefiles[i]);
+        if (traces[num]->data_bytes > peak_bytes)
+            peak_bytes = traces[num]->data_bytes;
+        num++;
+    }
+    if (num == 0)
+    {
+        free(traces);
+        return;
+    }
+
+    mem_init(false);
+    if (!mm_init())
+        app_error("mm_init failed in soak_test");
+
+    printf("\nSoak: %d rounds of %d traces on one heap:\n", soak_rounds, num);
+    printf("%6s%10s%12s%8s%12s%10s\n", "round", "Kops/s", "heap KB", "util",
+           "free blks", "longest");
+    for (r = 1; r <= soak_rounds; r++)
+    {
+        secs = ops = 0.0;
+        for (i = 0; i < num; i++)
+        {
+            reinit_trace(traces[i]);
+            start_timer();
+            replay_speed(traces[i], 0, traces[i]->num_ops, mm_malloc,
+                         mm_realloc_unchecked, mm_free, "mm");
+            secs += get_timer();
+            ops += traces[i]->num_ops;
+            /* Look at the free lists while the last trace's blocks are
+               still allocated; once they are freed, most coalesce away */
+            if (i == num - 1 && mm_free_list_lengths)
+                num_lists = mm_free_list_lengths(lengths, MAX_FREE_LISTS);
+            free_outstanding(traces[i], mm_free);
+        }
+        heap = (double)mem_heapsize();
+        tput = ops / (secs * 1000.0);
+        if (r == 1)
+        {
+            first_tput = tput;
+            first_heap = heap;
+        }
+        printf("%6d%10.0f%12.0f%7.1f%%", r, tput, heap / 1024,
+               100.0 * peak_bytes / heap);
+        if (mm_free_list_lengths)
+        {
+            free_blocks = longest = 0;
+            for (j = 0; j < (size_t)num_lists; j++)
+            {
+                free_blocks += lengths[j];
+                if (lengths[j] > longest)
+                    longest = lengths[j];
+            }
+            printf("%12zu%10zu\n", free_blocks, longest);
+            if (verbose > 1)
+            {
+                printf("      lists:");
+                for (j = 0; j < (size_t)num_lists; j++)
+                    printf(" %zu", lengths[j]);
+                printf("\n");
+            }
+        }
+        else
+            printf("%12s%10s\n", "-", "-");
+    }
+    printf("Drift over %d rounds: throughput %.2fx, heap %.2fx\n", soak_rounds,
+           tput / first_tput, heap / first_heap);
+
+    for (i = 0; i < num; i++)
+        free_trace(traces[i]);
+    free(traces);
+    mem_deinit();
+}
+
+/*
+ * The comparison (-x) replays each trace against each chosen allocator
+ * three times: counting the live payload, for the utilization; timed as
+ * a whole, for the throughput; and timing each request alone, for the
+ * latency percentiles.  libc's heap size is not known, so it gets no
+ * utilization.
+ */
+static const double lat_pcts[] = {0.50, 0.99, 0.999, 1.0};
+static const char *lat_names[] = {"p50", "p99", "p99.9", "max"};
+#define NUM_LAT_PCTS ((int)(sizeof(lat_pcts) / sizeof(lat_pcts[0])))
+
+/* Results for one trace and one allocator */
+typedef struct
+{
+    bool valid;               /* the allocator got through the trace */
+    double ops;               /* number of requests in the trace */
+    double util;              /* peak payload over heap size, or -1 */
+    double secs;              /* secs needed to replay the trace */
+    double lat[NUM_LAT_PCTS]; /* request latency percentiles, in ns */
+} cmp_t;
+
+/* Reset the heap and initialize the mm package */
+static bool mm_start(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+/* Reset the heap and initialize mm-naive.c */
+static bool naive_start(void)
+{
+    mem_reset_brk();
+    return naive_mm_init();
+}
+
+/* Index of the allocator with the given name, or -1 */
+static int find_allocator(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_ALLOCATORS; i++)
+    {
+        if (strcmp(name, allocators[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * parse_allocators - Choose the allocators to compare from a comma
+ *    separated list of their names, or "all" for every one linked in.
+ */
+static void parse_allocators(const char *list)
+{
+    char names[MAXLINE], *name;
+    int i, j;
+
+    if (strlen(list) >= MAXLINE)
+        app_error("-x: allocator list too long\n");
+    strcpy(names, list);
+    for (name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        if (strcmp(name, "all") == 0)
+        {
+            num_cmp_allocs = 0;
+            for (i = 0; i < NUM_ALLOCATORS; i++)
+            {
+                if (allocators[i].malloc_fn != NULL)
+                    cmp_allocs[num_cmp_allocs++] = i;
+            }
+            return;
+        }
+        if ((i = find_allocator(name)) < 0)
+            app_error("-x: no allocator named %s\n", name);
+        if (allocators[i].malloc_fn == NULL)
+            app_error("-x: %s is not linked into this driver\n", name);
+        for (j = 0; j < num_cmp_allocs; j++)
+        {
+            if (cmp_allocs[j] == i)
+                app_error("-x: %s is named twice\n", name);
+        }
+        cmp_allocs[num_cmp_allocs++] = i;
+    }
+    if (num_cmp_allocs == 0)
+        app_error("-x expects a list of allocators\n");
+}
+
+/* Nanoseconds from t0 to t1 */
+static uint32_t elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+    return (uint32_t)((t1->tv_sec - t0->tv_sec) * 1000000000L +
+                      (t1->tv_nsec - t0->tv_nsec));
+}
+
+/*
+ * cmp_replay - Replay the trace with the allocator a.  If sizes is not
+ *    NULL, track the live payload and return its peak in *peak; if ns is
+ *    not NULL, time each request into ns.  Returns false if the
+ *    allocator fails to set up or runs out of memory.
+ */
+static bool cmp_replay(trace_t *trace, const allocator_t *a, size_t *peak,
+                       uint32_t *ns)
+{
+    int i, index;
+    traceop_t op;
+    char *p;
+    size_t size, total = 0;
+    struct timespec t0, t1;
+
+    reinit_trace(trace);
+    if (a->init && !a->init())
+        return false;
+    if (peak)
+        *peak = 0;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        op = trace->ops[i];
+        index = OP_INDEX(op);
+        size = trace->sizes[i];
+        if (ns)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        switch (OP_TYPE(op))
+        {
+        case ALLOC:
+            if ((p = a->malloc_fn(size)) == NULL)
+                return false;
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            if ((p = a->realloc_fn(trace->blocks[index], size)) == NULL &&
+                size != 0)
+                return false;
+            trace->blocks[index] = p;
+            break;
+
+        case FREE:
+            a->free_fn(trace->blocks[index]);
+            size = 0;
+            break;
+
+        default:
+            app_error("Nonexistent request type in cmp_replay\n");
+        }
+        if (ns)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[i] = elapsed_ns(&t0, &t1);
+        }
+        if (peak && index >= 0)
+        {
+            total += size - trace->block_sizes[index];
+            trace->block_sizes[index] = size;
+            if (total > *peak)
+                *peak = total;
+        }
+    }
+    return true;
+}
+
+/* Time one replay of the trace with the allocator in params, for fcyc */
+static void eval_cmp_speed(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+    const allocator_t *a = params->alloc;
+
+    reinit_trace(params->trace);
+    if (a->init && !a->init())
+        app_error("%s failed to initialize in eval_cmp_speed\n", a->name);
+    replay_speed(params->trace, 0, params->trace->num_ops, a->malloc_fn,
+                 a->realloc_fn, a->free_fn, a->name);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Fill pct with the latency percentiles of the num requests in ns */
+static void latency_percentiles(uint32_t *ns, size_t num, double *pct)
+{
+    int i;
+
+    qsort(ns, num, sizeof(uint32_t), compare_ns);
+    for (i = 0; i < NUM_LAT_PCTS; i++)
+        pct[i] = num > 0 ? ns[(size_t)(lat_pcts[i] * (num - 1))] : 0;
+}
+
+/*
+ * correct_latencies - Take the timer's own cost, the least time between
+ *    two readings of it, off each of the num latencies in ns.
+ */
+static void correct_latencies(uint32_t *ns, size_t num)
+{
+    int i;
+    size_t j;
+    uint32_t overhead = UINT32_MAX;
+    struct timespec t0, t1;
+
+    for (i = 0; i < LAT_TIMER_READS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (elapsed_ns(&t0, &t1) < overhead)
+            overhead = elapsed_ns(&t0, &t1);
+    }
+    for (j = 0; j < num; j++)
+        ns[j] = ns[j] > overhead ? ns[j] - overhead : 0;
+}
+
+/*
+ * eval_cmp - Measure one trace with one allocator, with the latencies
+ *    corrected for the timer's cost.
+ */
+static void eval_cmp(trace_t *trace, const allocator_t *a, cmp_t *cmp)
+{
+    size_t peak;
+    uint32_t *ns;
+    speed_t params;
+    stats_t stats;
+
+    memset(cmp, 0, sizeof(cmp_t));
+    cmp->ops = trace->num_ops;
+    cmp->valid = cmp_replay(trace, a, &peak, NULL) &&
+                 (a->checkheap == NULL || a->checkheap(__LINE__));
+    if (a->init == NULL)
+        free_outstanding(trace, a->free_fn);
+    if (!cmp->valid)
+        return;
+    cmp->util = a->heapsize ? (double)peak / a->heapsize() : -1;
+
+    memset(&params, 0, sizeof(params));
+    params.trace = trace;
+    params.alloc = a;
+    stats.ops = trace->num_ops;
+    measure_speed(eval_cmp_speed, &params, &stats);
+    cmp->secs = stats.secs;
+    if (a->init == NULL)
+        free_outstanding(trace, a->free_fn);
+
+    if ((ns = malloc(trace->num_ops * sizeof(uint32_t))) == NULL)
+        unix_error("ns malloc in eval_cmp failed");
+    if (!cmp_replay(trace, a, NULL, ns))
+        app_error("%s failed on a replay it passed before\n", a->name);
+    if (a->init == NULL)
+        free_outstanding(trace, a->free_fn);
+    correct_latencies(ns, trace->num_ops);
+    latency_percentiles(ns, trace->num_ops, cmp->lat);
+    free(ns);
+}
+
+/*
+ * compare_allocators - Run each trace against each allocator chosen
+ *    with -x, and print the results side by side, a line for each
+ *    allocator on each trace, then each allocator's averages.  With -B
+ *    and two allocators, also time the two with interleaved samples, as
+ *    -l does mm and libc, and report whether they differ.
+ */
+static void compare_allocators(int num_tracefiles, const char *tracedir,
+                               char **tracefiles)
+{
+    int i, j, k, n;
+    double util, ops, secs;
+    stats_t scratch;
+    trace_t *trace;
+    speed_t fparams, gparams;
+    bool pair = bench_samples > 0 && num_cmp_allocs == 2;
+    cmp_t *cmp = calloc((size_t)num_tracefiles * num_cmp_allocs,
+                        sizeof(cmp_t));
+    fcompare_t *pairs = calloc(num_tracefiles, sizeof(fcompare_t));
+
+    if (cmp == NULL || pairs == NULL)
+        unix_error("cmp calloc in compare_allocators failed");
+
+    printf("\nComparison of %d allocators (latency in ns):\n",
+           num_cmp_allocs);
+    printf("%-8s%8s%10s", "alloc", "util", "Kops/s");
+    for (k = 0; k < NUM_LAT_PCTS; k++)
+        printf("%8s", lat_names[k]);
+    printf("  trace\n");
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        trace = read_trace(&scratch, tracedir, tracefiles[i]);
+        for (j = 0; j < num_cmp_allocs; j++)
+        {
+            cmp_t *c = &cmp[i * num_cmp_allocs + j];
+
+            mem_init(false);
+            eval_cmp(trace, &allocators[cmp_allocs[j]], c);
+            mem_deinit();
+
+            printf("%-8s", allocators[cmp_allocs[j]].name);
+            if (!c->valid)
+            {
+                printf("%8s%10s%*s  %s\n", "failed", "", 8 * NUM_LAT_PCTS,
+                       "", trace->filename);
+                continue;
+            }
+            if (c->util < 0)
+                printf("%8s", "-");
+            else
+                printf("%7.1f%%", 100.0 * c->util);
+            printf("%10.0f", c->ops / (c->secs * 1000.0));
+            for (k = 0; k < NUM_LAT_PCTS; k++)
+                printf("%8.0f", c->lat[k]);
+            printf("  %s\n", trace->filename);
+        }
+        if (pair && cmp[i * 2].valid && cmp[i * 2 + 1].valid)
+        {
+            memset(&fparams, 0, sizeof(fparams));
+            fparams.trace = trace;
+            gparams = fparams;
+            fparams.alloc = &allocators[cmp_allocs[0]];
+            gparams.alloc = &allocators[cmp_allocs[1]];
+            mem_init(false);
+            fsec_compare(eval_cmp_speed, &fparams, eval_cmp_speed, &gparams,
+                         &pairs[i]);
+            mem_deinit();
+        }
+        free_trace(trace);
+    }
+
+    /* Averages over the traces each allocator got through */
+    for (j = 0; j < num_cmp_allocs; j++)
+    {
+        const allocator_t *a = &allocators[cmp_allocs[j]];
+
+        util = ops = secs = 0.0;
+        n = 0;
+        for (i = 0; i < num_tracefiles; i++)
+        {
+            cmp_t *c = &cmp[i * num_cmp_allocs + j];
+
+            if (!c->valid)
+                continue;
+            n++;
+            util += c->util;
+            ops += c->ops;
+            secs += c->secs;
+        }
+        printf("%-8s", a->name);
+        if (n == 0)
+        {
+            printf("%8s%10s%*s  average\n", "failed", "", 8 * NUM_LAT_PCTS,
+                   "");
+            continue;
+        }
+        if (a->heapsize == NULL)
+            printf("%8s", "-");
+        else
+            printf("%7.1f%%", 100.0 * util / n);
+        printf("%10.0f%*s  average", ops / (secs * 1000.0), 8 * NUM_LAT_PCTS,
+               "");
+        if (n < num_tracefiles)
+            printf(" of the %d traces it got through", n);
+        printf("\n");
+    }
+
+    if (pair)
+    {
+        char ratio[MAXLINE], name[MAXLINE];
+
+        snprintf(ratio, sizeof(ratio), "%s/%s", allocators[cmp_allocs[0]].name,
+                 allocators[cmp_allocs[1]].name);
+        printf("\nInterleaved comparison of %s with %s (%.0f%% "
+               "intervals):\n",
+               allocators[cmp_allocs[0]].name, allocators[cmp_allocs[1]].name,
+               100.0 * BENCH_CONFIDENCE);
+        printf("  %8s  %17s  %5s  %s\n", ratio, "interval", "sig?", "trace");
+        for (i = 0; i < num_tracefiles; i++)
+        {
+            if (!cmp[i * 2].valid || !cmp[i * 2 + 1].valid)
+                continue;
+            snprintf(name, sizeof(name), "%s%s", tracedir, tracefiles[i]);
+            print_fcompare(&pairs[i], name);
+        }
+    }
+    free(cmp);
+    free(pairs);
+}
+
+/*
+ * The threaded replay (-j) runs one copy of the trace on each of T
+ * threads, or with :part splits the trace's requests between them by
+ * block id, against a thread-safe allocator: libc, or the malloc, free
+ * and realloc of the library given with -L.  It measures 1, 2, 4, ...
+ * threads up to T, each thread pinned to its own CPU where there are
+ * enough, and times each count of threads twice: as a whole, for the
+ * aggregate throughput, and timing each request, for the latencies.
+ */
+typedef struct
+{
+    pthread_t tid;
+    int cpu;                  /* CPU the thread is pinned to */
+    trace_t *trace;           /* the thread's copy or share of the trace */
+    uint32_t *ns;             /* latency of each request, if being timed */
+    struct timespec start, end;
+    double secs;              /* time of the thread's last replay */
+    double lat[NUM_LAT_PCTS]; /* its latency percentiles, in ns */
+    bool ok;                  /* the allocator got through the requests */
+    int *mine;                /* recorded replay (-y): the thread's requests */
+    int num_mine;
+    long waits;               /* requests that waited for another thread */
+    double max_lag;           /* most secs a request ran behind its time */
+} worker_t;
+
+static pthread_barrier_t thread_barrier;
+
+/*
+ * load_thread_alloc - Return the allocator for the threaded replay:
+ *    libc's, or if path is not NULL, the malloc, free and realloc that
+ *    the shared library at path defines.  The library is loaded with
+ *    its symbols kept to itself, so it doesn't take over the driver's
+ *    own allocations.  It must define mm_thread_safe, as mm-mt.so does,
+ *    to say it may be called from several threads at once; mm.so may
+ *    not be.
+ */
+static const allocator_t *load_thread_alloc(const char *path)
+{
+    static allocator_t lib;
+    void *handle;
+
+    if (path == NULL)
+        return &allocators[find_allocator("libc")];
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+        app_error("-L: %s\n", dlerror());
+    if (dlsym(handle, "mm_thread_safe") == NULL)
+        app_error("-L: %s is not marked thread-safe (build mm-mt.so "
+                  "rather than mm.so)\n",
+                  path);
+    lib.name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    lib.malloc_fn = (void *(*)(size_t))dlsym(handle, "malloc");
+    lib.realloc_fn = (void *(*)(void *, size_t))dlsym(handle, "realloc");
+    lib.free_fn = (void (*)(void *))dlsym(handle, "free");
+    if (!lib.malloc_fn || !lib.realloc_fn || !lib.free_fn)
+        app_error("-L: %s lacks malloc, realloc or free\n", path);
+    return &lib;
+}
+
+/*
+ * assign_cpus - Pin the n workers to the CPUs the driver may run on, in
+ *    turn, and warn once if there are fewer CPUs than workers.
+ */
+static void assign_cpus(worker_t *workers, int n)
+{
+    int i, num_cpus = 0;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t set;
+    static bool warned = false;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        unix_error("sched_getaffinity failed in assign_cpus");
+    for (i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (CPU_ISSET(i, &set))
+            cpus[num_cpus++] = i;
+    }
+    for (i = 0; i < n; i++)
+        workers[i].cpu = cpus[i % num_cpus];
+    if (n > num_cpus && !warned)
+    {
+        fprintf(stderr, "Warning: %d threads share %d CPUs\n", n, num_cpus);
+        warned = true;
+    }
+}
+
+/*
+ * thread_trace - Make the trace replayed by thread k of n: a copy of
+ *    the whole trace, or with partition set, the requests for the block
+ *    ids that fall to k.  The copy has its own block array.
+ */
+static trace_t *thread_trace(const trace_t *trace, int k, int n,
+                             bool partition)
+{
+    int i, index, num = 0;
+    trace_t *t = malloc(sizeof(trace_t));
+
+    if (t == NULL)
+        unix_error("malloc failed in thread_trace");
+    *t = *trace;
+    t->ops = malloc((trace->num_ops + PREFETCH_DIST) * sizeof(traceop_t));
+    t->sizes = calloc(trace->num_ops + PREFETCH_DIST, sizeof(size_t));
+    t->blocks = calloc(trace->num_ids + 1, sizeof(char *));
+    t->block_sizes = calloc(trace->num_ids, sizeof(size_t));
+    t->block_rand_base = NULL;
+    t->tids = NULL;
+    t->times = NULL;
+    if (!t->ops || !t->sizes || !t->blocks || !t->block_sizes)
+        unix_error("malloc failed in thread_trace");
+    t->blocks++;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = OP_INDEX(trace->ops[i]);
+        if (partition && (index >= 0 ? index : i) % n != k)
+            continue;
+        t->ops[num] = trace->ops[i];
+        t->sizes[num++] = trace->sizes[i];
+    }
+    for (i = 0; i < PREFETCH_DIST; i++)
+        t->ops[num + i] = OP_PACK(FREE, -1);
+    t->num_ops = num;
+    return t;
+}
+
+/* Body of each thread: replay the thread's trace once all are ready */
+static void *thread_replay(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    const allocator_t *a = thread_alloc;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    reinit_trace(w->trace);
+
+    pthread_barrier_wait(&thread_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    if (w->ns)
+        w->ok = cmp_replay(w->trace, a, NULL, w->ns);
+    else
+    {
+        replay_speed(w->trace, 0, w->trace->num_ops, a->malloc_fn,
+                     a->realloc_fn, a->free_fn, a->name);
+        w->ok = true;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w->end);
+
+    free_outstanding(w->trace, a->free_fn);
+    return NULL;
+}
+
+/*
+ * run_threads - Replay on n threads at once, and return the time from
+ *    the first thread starting to the last one finishing, or -1 if the
+ *    allocator failed in any of them.
+ */
+static double run_threads(worker_t *workers, int n)
+{
+    int k;
+    bool ok = true;
+    double start, end, first = DBL_MAX, last = 0.0;
+
+    if (pthread_barrier_init(&thread_barrier, NULL, n) != 0)
+        unix_error("pthread_barrier_init failed in run_threads");
+    for (k = 0; k < n; k++)
+    {
+        if (pthread_create(&workers[k].tid, NULL, thread_replay,
+                           &workers[k]) != 0)
+            unix_error("pthread_create failed in run_threads");
+    }
+    for (k = 0; k < n; k++)
+    {
+        pthread_join(workers[k].tid, NULL);
+        ok = ok && workers[k].ok;
+        start = workers[k].start.tv_sec + workers[k].start.tv_nsec / 1e9;
+        end = workers[k].end.tv_sec + workers[k].end.tv_nsec / 1e9;
+        workers[k].secs = end - start;
+        if (start < first)
+            first = start;
+        if (end > last)
+            last = end;
+    }
+    pthread_barrier_destroy(&thread_barrier);
+    return ok ? last - first : -1;
+}
+
+/*
+ * thread_test - Measure the scaling of the thread-safe allocator on
+ *    each trace, from one thread to num_threads, with the latencies of
+ *    each of the num_threads threads under the last line.
+ */
+static void thread_test(int num_tracefiles, const char *tracedir,
+                        char **tracefiles)
+{
+    int i, k, n, r;
+    size_t ops, pooled;
+    double secs, best, tput, base = 0.0, pct[NUM_LAT_PCTS];
+    uint32_t *all_ns;
+    stats_t scratch;
+    trace_t *trace;
+    worker_t *workers = calloc(num_threads, sizeof(worker_t));
+
+    if (workers == NULL)
+        unix_error("workers calloc in thread_test failed");
+    assign_cpus(workers, num_threads);
+
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        trace = read_trace(&scratch, tracedir, tracefiles[i]);
+        printf("\nThreaded replay of %s, %s, with %s:\n", trace->filename,
+               thread_partition ? "split by block id" : "a copy per thread",
+               thread_alloc->name);
+        printf("%8s%10s%9s%8s", "threads", "Kops/s", "speedup", "effic");
+        for (r = 0; r < NUM_LAT_PCTS; r++)
+            printf("%8s", lat_names[r]);
+        printf("\n");
+
+        for (n = 1;; n = n * 2 < num_threads ? n * 2 : num_threads)
+        {
+            ops = 0;
+            for (k = 0; k < n; k++)
+            {
+                workers[k].trace = thread_trace(trace, k, n, thread_partition);
+                workers[k].ns = NULL;
+                ops += workers[k].trace->num_ops;
+            }
+
+            /* Throughput: the best of THREAD_RUNS whole replays */
+            best = -1;
+            for (r = 0; r < THREAD_RUNS; r++)
+            {
+                if ((secs = run_threads(workers, n)) < 0)
+                    break;
+                if (best < 0 || secs < best)
+                    best = secs;
+            }
+            if (secs < 0)
             {
-                block = 0;
+                printf("%8d%10s\n", n, "failed");
+                for (k = 0; k < n; k++)
+                    free_trace(workers[k].trace);
+                break;
             }
-            else
+            tput = ops / (best * 1000.0);
+            if (n == 1)
+                base = tput;
+
+            /* Latencies, pooled over the threads */
+            if ((all_ns = malloc(ops * sizeof(uint32_t))) == NULL)
+                unix_error("all_ns malloc in thread_test failed");
+            for (pooled = 0, k = 0; k < n; k++)
+            {
+                workers[k].ns = &all_ns[pooled];
+                pooled += workers[k].trace->num_ops;
+            }
+            if (run_threads(workers, n) < 0)
+                app_error("%s failed on a replay it passed before\n",
+                          thread_alloc->name);
+
+            correct_latencies(all_ns, ops);
+            for (k = 0; k < n; k++)
+                latency_percentiles(workers[k].ns, workers[k].trace->num_ops,
+                                    workers[k].lat);
+            latency_percentiles(all_ns, ops, pct);
+            printf("%8d%10.0f%8.2fx%7.0f%%", n, tput, tput / base,
+                   100.0 * tput / (n * base));
+            for (r = 0; r < NUM_LAT_PCTS; r++)
+                printf("%8.0f", pct[r]);
+            printf("\n");
+
+            /* Each thread on its own, labelled thread@cpu */
+            for (k = 0; n == num_threads && n > 1 && k < n; k++)
             {
-                block = trace->blocks[index];
+                printf("%5d@%-2d%10.0f%17s", k, workers[k].cpu,
+                       workers[k].trace->num_ops / (workers[k].secs * 1000.0),
+                       "");
+                for (r = 0; r < NUM_LAT_PCTS; r++)
+                    printf("%8.0f", workers[k].lat[r]);
+                printf("\n");
             }
-            mm_free(block);
+
+            free(all_ns);
+            for (k = 0; k < n; k++)
+                free_trace(workers[k].trace);
+            if (n == num_threads)
+                break;
+        }
+        free_trace(trace);
+    }
+    free(workers);
+}
+
+/*
+ * The recorded replay (-y) runs a trace on the threads it records, each
+ * thread making its own requests in order on the shared block array, so
+ * blocks freed or reallocated by another thread than the one that got
+ * them are handed across as they were.  A request on a block waits
+ * until the request before it on that block, in trace order, is done.
+ * In causal order that is the only wait; at recorded timing, a request
+ * also waits until its time after the earliest in the trace, counted
+ * from the start of the replay.
+ */
+static const trace_t *rec_trace; /* trace being replayed */
+static int *rec_prev;            /* previous request on each one's block */
+static int *rec_done;            /* last request done on each block */
+
+/* Seconds on the monotonic clock */
+static double now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Body of each thread of the recorded replay */
+static void *recorded_replay(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    const allocator_t *a = thread_alloc;
+    const trace_t *trace = rec_trace;
+    cpu_set_t set;
+    int j, i, index;
+    traceop_t op;
+    char *p;
+    double start, due, late;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    pthread_barrier_wait(&thread_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    start = w->start.tv_sec + w->start.tv_nsec / 1e9;
+    for (j = 0; j < w->num_mine; j++)
+    {
+        i = w->mine[j];
+        op = trace->ops[i];
+        index = OP_INDEX(op);
+        if (recorded_mode == REC_TIMED && trace->times)
+        {
+            due = start +
+                  (int64_t)(trace->times[i] - trace->time_lo) / 1e9;
+            while (now_secs() < due)
+                sched_yield();
+            if ((late = now_secs() - due) > w->max_lag)
+                w->max_lag = late;
+        }
+        if (index >= 0 &&
+            __atomic_load_n(&rec_done[index], __ATOMIC_ACQUIRE) != rec_prev[i])
+        {
+            w->waits++;
+            while (__atomic_load_n(&rec_done[index], __ATOMIC_ACQUIRE) !=
+                   rec_prev[i])
+                sched_yield();
+        }
+        switch (OP_TYPE(op))
+        {
+        case ALLOC:
+            if ((p = a->malloc_fn(trace->sizes[i])) == NULL)
+                app_error("%s malloc error in recorded replay\n", a->name);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            if ((p = a->realloc_fn(trace->blocks[index], trace->sizes[i])) ==
+                    NULL &&
+                trace->sizes[i] != 0)
+                app_error("%s realloc error in recorded replay\n", a->name);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE:
+            a->free_fn(trace->blocks[index]);
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in recorded replay\n");
+        }
+        if (index >= 0)
+            __atomic_store_n(&rec_done[index], i, __ATOMIC_RELEASE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w->end);
+    return NULL;
+}
+
+/*
+ * recorded_test - Replay each trace on the threads it records, in
+ *    causal order or at the recorded timing, and report the throughput,
+ *    how many frees and reallocs were of blocks another thread
+ *    allocated, how many requests waited for another thread, and
+ *    at recorded timing, how far the replay fell behind.  A version 1
+ *    trace is replayed on a single thread.
+ */
+static void recorded_test(int num_tracefiles, const char *tracedir,
+                          char **tracefiles)
+{
+    int i, k, n, tid, index, *last, *alloc_tid;
+    long remote, waits;
+    double first, end, secs, lag;
+    stats_t scratch;
+    trace_t *trace;
+    worker_t *workers, *w;
+
+    printf("\nRecorded replay %s, with %s:\n",
+           recorded_mode == REC_TIMED ? "at recorded timing"
+                                      : "in causal order",
+           thread_alloc->name);
+    printf("%8s%9s%8s%8s%10s%10s", "threads", "ops", "remote", "waits",
+           "ms", "Kops/s");
+    if (recorded_mode == REC_TIMED)
+        printf("%11s%9s", "recorded", "lag ms");
+    printf("  trace\n");
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        trace = read_trace(&scratch, tracedir, tracefiles[i]);
+        n = trace->num_threads;
+        reinit_trace(trace);
+        workers = calloc(n, sizeof(worker_t));
+        rec_prev = malloc(trace->num_ops * sizeof(int));
+        rec_done = malloc(trace->num_ids * sizeof(int));
+        last = malloc(trace->num_ids * sizeof(int));
+        alloc_tid = malloc(trace->num_ids * sizeof(int));
+        if (!workers || !rec_prev || !rec_done || !last || !alloc_tid)
+            unix_error("malloc failed in recorded_test");
+        for (k = 0; k < n; k++)
+        {
+            workers[k].mine = malloc(trace->num_ops * sizeof(int));
+            if (workers[k].mine == NULL)
+                unix_error("malloc failed in recorded_test");
+        }
+
+        /* Link each request to the one before it on its block, and
+           count the frees and reallocs of blocks that another thread
+           allocated */
+        memset(last, -1, trace->num_ids * sizeof(int));
+        memset(alloc_tid, -1, trace->num_ids * sizeof(int));
+        memset(rec_done, -1, trace->num_ids * sizeof(int));
+        remote = 0;
+        for (k = 0; k < trace->num_ops; k++)
+        {
+            tid = trace->tids ? trace->tids[k] : 0;
+            w = &workers[tid];
+            w->mine[w->num_mine++] = k;
+            index = OP_INDEX(trace->ops[k]);
+            rec_prev[k] = index >= 0 ? last[index] : -1;
+            if (index < 0)
+                continue;
+            if (OP_TYPE(trace->ops[k]) != ALLOC && alloc_tid[index] >= 0 &&
+                alloc_tid[index] != tid)
+                remote++;
+            last[index] = k;
+            if (OP_TYPE(trace->ops[k]) != FREE)
+                alloc_tid[index] = tid;
+        }
+
+        assign_cpus(workers, n);
+        rec_trace = trace;
+        if (pthread_barrier_init(&thread_barrier, NULL, n) != 0)
+            unix_error("pthread_barrier_init failed in recorded_test");
+        for (k = 0; k < n; k++)
+        {
+            if (pthread_create(&workers[k].tid, NULL, recorded_replay,
+                               &workers[k]) != 0)
+                unix_error("pthread_create failed in recorded_test");
+        }
+        first = DBL_MAX;
+        end = lag = 0.0;
+        waits = 0;
+        for (k = 0; k < n; k++)
+        {
+            pthread_join(workers[k].tid, NULL);
+            secs = workers[k].start.tv_sec + workers[k].start.tv_nsec / 1e9;
+            if (secs < first)
+                first = secs;
+            secs = workers[k].end.tv_sec + workers[k].end.tv_nsec / 1e9;
+            if (secs > end)
+                end = secs;
+            if (workers[k].max_lag > lag)
+                lag = workers[k].max_lag;
+            waits += workers[k].waits;
         }
+        pthread_barrier_destroy(&thread_barrier);
+        free_outstanding(trace, thread_alloc->free_fn);
+
+        secs = end - first;
+        printf("%8d%9d%8ld%8ld%10.3f%10.0f", n, trace->num_ops, remote, waits,
+               secs * 1e3, trace->num_ops / (secs * 1000.0));
+        if (recorded_mode == REC_TIMED)
+            printf("%11.3f%9.3f",
+                   trace->times
+                       ? (int64_t)(trace->time_hi - trace->time_lo) / 1e6
+                       : 0.0,
+                   lag * 1e3);
+        printf("  %s\n", trace->filename);
+
+        for (k = 0; k < n; k++)
+            free(workers[k].mine);
+        free(workers);
+        free(rec_prev);
+        free(rec_done);
+        free(last);
+        free(alloc_tid);
+        free_trace(trace);
+    }
+}
+
+/*
+ * measure_speed - Time one of the xxx_speed functions.  With -k all,
+ *    measure in every cache state and leave the hot numbers in stats.
+ */
+static void measure_speed(test_funct f, speed_t *params, stats_t *stats)
+{
+    int state;
+
+    if (cache_state != CACHE_ALL)
+    {
+        measure_once(f, params, stats);
+        return;
+    }
+    for (state = NUM_CACHE_STATES - 1; state >= 0; state--)
+    {
+        set_cache_state(state);
+        measure_once(f, params, stats);
+        stats->tput_cache[state] = stats->ops / (stats->secs * 1000.0);
+    }
 }
 
 /*
@@ -1484,33 +3964,33 @@ static bool eval_libc_valid(trace_t *trace)
 
     for (i = 0; i < trace->num_ops; i++)
     {
-        switch (trace->ops[i].type)
+        switch (OP_TYPE(trace->ops[i]))
         {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL)
+            if ((p = malloc(trace->sizes[i])) == NULL)
             {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = p;
+            trace->blocks[OP_INDEX(trace->ops[i])] = p;
             break;
 
         case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
+            newsize = trace->sizes[i];
+            oldp = trace->blocks[OP_INDEX(trace->ops[i])];
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
             {
                 malloc_error(trace, i, "libc realloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            trace->blocks[OP_INDEX(trace->ops[i])] = newp;
             break;
 
         case FREE: /* free */
-            if (trace->ops[i].index >= 0)
+            if (OP_INDEX(trace->ops[i]) >= 0)
             {
-                free(trace->blocks[trace->ops[i].index]);
+                free(trace->blocks[OP_INDEX(trace->ops[i])]);
             }
             else
             {
@@ -1533,47 +4013,48 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
-    int index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     reinit_trace(trace);
 
-    for (i = 0; i < trace->num_ops; i++)
-    {
-        switch (trace->ops[i].type)
-        {
-        case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
-                unix_error("malloc failed in eval_libc_speed");
-            trace->blocks[index] = p;
-            break;
+    replay_speed(trace, 0, trace->num_ops, malloc, realloc, free, "libc");
+}
 
-        case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-                unix_error("realloc failed in eval_libc_speed\n");
+/* Freed pointers go here so eval_null_speed can't skip loading them */
+static char *volatile null_sink;
 
-            trace->blocks[index] = newp;
+/*
+ * eval_null_speed - This is the function that is used by fcyc() to
+ *    measure the driver's own cost of interpreting a trace: the same
+ *    loop as replay_speed, with every allocator call replaced by a
+ *    dummy pointer.  Subtracting it from the mm time gives the time
+ *    spent inside the allocator.
+ */
+static void eval_null_speed(void *ptr)
+{
+    int i, num_ops;
+    traceop_t op;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    const traceop_t *ops = trace->ops;
+    const size_t *sizes = trace->sizes;
+    char **blocks = trace->blocks;
+
+    reinit_trace(trace);
+
+    num_ops = trace->num_ops;
+    for (i = 0; i < num_ops; i++)
+    {
+        op = ops[i];
+        __builtin_prefetch(&blocks[OP_INDEX(ops[i + PREFETCH_DIST])], 1);
+        switch (OP_TYPE(op))
+        {
+        case ALLOC:
+        case REALLOC:
+            blocks[OP_INDEX(op)] = (char *)sizes[i];
             break;
 
-        case FREE: /* free */
-            index = trace->ops[i].index;
-            if (index >= 0)
-            {
-                block = trace->blocks[index];
-                free(block);
-            }
-            else
-            {
-                free(0);
-            }
+        case FREE:
+            null_sink = blocks[OP_INDEX(op)];
             break;
         }
     }
@@ -1605,12 +4086,14 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     /* Print the individual results for each trace */
     if (tab_mode)
     {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\t%sops\tmsecs\tKops/s\t%strace\n",
+               rss_report ? "rss\t" : "", bench_samples ? "ci%\t" : "");
     }
     else
     {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %s%7s%8s%8s  %s%s\n", "valid", "util",
+               rss_report ? "     rss " : "", "ops", "msecs", "Kops/s",
+               bench_samples ? "  ci%  " : "", "trace");
     }
     for (i = 0; i < n; i++)
     {
@@ -1666,6 +4149,17 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf(" %8s", "--");
             }
 
+            /* Payload over resident bytes at the peak (-E) */
+            if (rss_report)
+            {
+                if (tab_mode)
+                    printf("%.1f\t", stats[i].rss_util * 100.0);
+                else if (stats[i].rss_peak > 0)
+                    printf(" %7.1f%%", stats[i].rss_util * 100.0);
+                else
+                    printf(" %8s", "-");
+            }
+
             /* Ops + Time */
             double msecs = sparse_mode ? 0.0 : stats[i].secs * 1000.0;
             double kops = sparse_mode ? 0.0 : stats[i].tput;
@@ -1683,8 +4177,27 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Half-width of the confidence interval, relative to median */
+            if (bench_samples)
+            {
+                double ci = 0.0;
+                if (!sparse_mode)
+                    ci = 50.0 * (stats[i].secs_hi - stats[i].secs_lo) /
+                         stats[i].secs;
+                if (tab_mode)
+                    printf("%.2f\t", ci);
+                else
+                    printf("%5.1f%% ", ci);
+            }
+
             printf("%s\n", stats[i].filename);
 
+            if (frag_report && !tab_mode && stats[i].frag_end.heap > 0)
+            {
+                print_frag("peak", &stats[i].frag_peak);
+                print_frag("end", &stats[i].frag_end);
+            }
+
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
             {
                 sum_perf_weight += 1;
@@ -1734,8 +4247,9 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         }
         else
         {
-            printf("%2d %2d  %7.1f%%%8.0f%10.3f\n", sum_util_weight,
-                   sum_perf_weight, util * 100.0, sumops, sumsecs * 1000.0);
+            printf("%2d %2d  %7.1f%%%s%8.0f%10.3f\n", sum_util_weight,
+                   sum_perf_weight, util * 100.0, rss_report ? "         " : "",
+                   sumops, sumsecs * 1000.0);
         }
 
         /* Record the summary statistics so we can compare libc and
@@ -1761,6 +4275,330 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * print_frag - prints one line of the fragmentation breakdown under a
+ *    trace in printresults: each kind of byte as a share of the heap
+ */
+static void print_frag(const char *when, const frag_t *frag)
+{
+    double heap = (double)frag->heap;
+    size_t free_total = 0;
+    int j;
+
+    for (j = 0; j < FRAG_BINS; j++)
+        free_total += frag->free_bytes[j];
+    printf("%10s:  payload %5.1f%%  hdr %5.1f%%  pad %5.1f%%  free %5.1f%% (",
+           when, 100.0 * frag->payload / heap, 100.0 * frag->overhead / heap,
+           100.0 * frag->padding / heap, 100.0 * free_total / heap);
+    for (j = 0; j < FRAG_BINS; j++)
+        printf("%s%s %.1f%%", j > 0 ? ", " : "", frag_bin_names[j],
+               100.0 * frag->free_bytes[j] / heap);
+    printf(")\n");
+}
+
+/* Print num / den as a percentage, or a dash if den is zero */
+static void print_rate(long num, long den)
+{
+    if (den > 0)
+        printf("%7.1f%%", 100.0 * num / den);
+    else
+        printf("%8s", "-");
+}
+
+/*
+ * print_profile - prints the emulated heap accesses of each kind of
+ *    request, per request, with the hit rates in the simulated caches.
+ *    The L2 hit rate is that of the L1 misses.
+ */
+static void print_profile(int n, stats_t *stats)
+{
+    int i, k;
+    const prof_t *p;
+
+    printf("\nEmulated heap accesses per request (L1 %d KB %d-way, "
+           "L2 %d KB %d-way, %d-entry TLB):\n",
+           PROF_L1_BYTES / 1024, PROF_L1_WAYS, PROF_L2_BYTES / 1024,
+           PROF_L2_WAYS, PROF_TLB_ENTRIES);
+    printf("%-8s%9s%9s%8s%8s%8s%8s%8s  %s\n", "request", "count", "access",
+           "lines", "pages", "L1 hit", "L2 hit", "TLB hit", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        for (k = 0; k < NUM_PROF_KINDS; k++)
+        {
+            p = &stats[i].prof[k];
+            if (p->ops == 0)
+                continue;
+            printf("%-8s%9ld%9.1f%8.1f%8.1f", prof_kind_names[k], p->ops,
+                   (double)p->accesses / p->ops, (double)p->lines / p->ops,
+                   (double)p->pages / p->ops);
+            print_rate(p->l1_hits, p->line_refs);
+            print_rate(p->l2_hits, p->line_refs - p->l1_hits);
+            print_rate(p->tlb_hits, p->page_refs);
+            printf("  %s\n", stats[i].filename);
+        }
+    }
+}
+
+/*
+ * print_rss - prints the resident and written bytes of the heap when
+ *    the most payload was allocated and at the end of each trace, with
+ *    the heap size and the payload at the peak for comparison.  Since
+ *    the payloads are never written, an allocator that leaves large
+ *    blocks untouched can have more payload than resident bytes.
+ */
+static void print_rss(int n, stats_t *stats)
+{
+    int i;
+
+    printf("\nResident heap pages (KB), at the peak and at the end; the "
+           "driver writes no\npayloads, so pages are resident only where "
+           "the allocator has touched them:\n");
+    printf("%10s%10s%10s%10s%10s%10s%8s  %s\n", "heap", "payload", "rss",
+           "written", "rss end", "wr end", "rss%", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.0f%10.0f%10.0f", stats[i].heap_peak / 1024.0,
+               stats[i].rss_util * stats[i].rss_peak / 1024.0,
+               stats[i].rss_peak / 1024.0);
+        if (rss_written_known)
+            printf("%10.0f", stats[i].written_peak / 1024.0);
+        else
+            printf("%10s", "-");
+        printf("%10.0f", stats[i].rss_end / 1024.0);
+        if (rss_written_known)
+            printf("%10.0f", stats[i].written_end / 1024.0);
+        else
+            printf("%10s", "-");
+        printf("%7.1f%%  %s\n", stats[i].rss_util * 100.0, stats[i].filename);
+    }
+}
+
+/*
+ * print_app - prints the throughput of the application replay next to
+ *    that of the plain replay, and the locality of the allocations
+ */
+static void print_app(int n, stats_t *stats)
+{
+    int i;
+
+    printf("\nApplication replay, touching %.0f%% of each payload",
+           touch_fraction * 100.0);
+    if (think_iters > 0)
+        printf(" and thinking %d steps per request", think_iters);
+    printf(":\n");
+    printf("%10s%10s%9s%12s%8s%8s  %s\n", "Kops/s", "app", "slowdown",
+           "malloc dist", "near", "span", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.0f%10.0f%8.2fx%12.0f%7.1f%%%8.2f  %s\n",
+               stats[i].ops / (stats[i].secs * 1000.0),
+               stats[i].ops / (stats[i].app_secs * 1000.0),
+               stats[i].app_secs / stats[i].secs, stats[i].alloc_dist,
+               100.0 * stats[i].near_allocs, stats[i].live_span,
+               stats[i].filename);
+    }
+}
+
+/*
+ * print_libc_comparison - prints the interleaved mm vs. libc comparison
+ * gathered in robust benchmark mode.  Ratios above 1 mean mm is faster.
+ */
+static void print_libc_comparison(int n, stats_t *stats)
+{
+    int i;
+
+    printf("\nInterleaved comparison with libc malloc (%.0f%% intervals):\n",
+           100.0 * BENCH_CONFIDENCE);
+    printf("  %8s  %17s  %5s  %s\n", "mm/libc", "interval", "sig?", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (stats[i].valid)
+            print_fcompare(&stats[i].libc_cmp, stats[i].filename);
+    }
+}
+
+/*
+ * print_fcompare - prints one row of an interleaved comparison: the
+ *    throughput ratio, its interval, and whether it differs from 1
+ */
+static void print_fcompare(const fcompare_t *cmp, const char *name)
+{
+    /* Times are inverse to throughput, so invert the ratio */
+    printf("  %8.3f  [%6.3f, %6.3f]  %5s  %s\n", 1.0 / cmp->ratio,
+           1.0 / cmp->ratio_hi, 1.0 / cmp->ratio_lo,
+           cmp->significant ? "yes" : "no", name);
+}
+
+/*
+ * print_cache_states - prints throughput measured in each cache state
+ */
+static void print_cache_states(int n, stats_t *stats)
+{
+    int i, state;
+
+    printf("\nThroughput (Kops/s) by cache state:\n");
+    for (state = 0; state < NUM_CACHE_STATES; state++)
+        printf("%8s", cache_state_names[state]);
+    printf("  %s\n", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        for (state = 0; state < NUM_CACHE_STATES; state++)
+            printf("%8.0f", stats[i].tput_cache[state]);
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
+/*
+ * print_interp_overhead - prints the time the driver spends interpreting
+ *    each trace, alone and as a fraction of the mm time
+ */
+static void print_interp_overhead(int n, stats_t *stats)
+{
+    int i;
+
+    printf("\nTrace interpretation overhead:\n");
+    printf("%10s%10s%8s  %s\n", "secs", "ns/op", "%mm", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.6f%10.2f%7.1f%%  %s\n", stats[i].interp_secs,
+               1e9 * stats[i].interp_secs / stats[i].ops,
+               100.0 * stats[i].interp_secs / stats[i].secs,
+               stats[i].filename);
+    }
+}
+
+/*
+ * print_calibration - prints the time spent inside the mm package, i.e.
+ *    the mm time minus the bump allocator time, with the noise of the
+ *    difference taken from the two confidence intervals
+ */
+static void print_calibration(int n, stats_t *stats)
+{
+    int i;
+    double alloc_secs, noise;
+
+    printf("\nAllocator-only time (mm minus bump allocator):\n");
+    printf("%10s%10s%10s%9s%10s%9s  %s\n", "mm ms", "bump ms", "alloc ms",
+           "+/- ms", "ns/op", "Kops/s", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        alloc_secs = stats[i].calib_secs - stats[i].bump_secs;
+        noise = ((stats[i].calib_hi - stats[i].calib_lo) +
+                 (stats[i].bump_hi - stats[i].bump_lo)) /
+                2;
+        printf("%10.3f%10.3f%10.3f%9.3f%10.2f", stats[i].calib_secs * 1e3,
+               stats[i].bump_secs * 1e3, alloc_secs * 1e3, noise * 1e3,
+               1e9 * alloc_secs / stats[i].ops);
+        if (alloc_secs > noise)
+            printf("%9.0f", stats[i].ops / (alloc_secs * 1000.0));
+        else
+            printf("%9s", "-");
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
+/*
+ * print_hugepages - prints the throughput and dTLB misses per operation
+ *    with the heap on normal pages and on huge pages
+ */
+static void print_hugepages(int n, stats_t *stats)
+{
+    int i;
+
+    printf("\nHuge pages (%d KB) for the heap:\n", HUGE_PAGE_SIZE / 1024);
+    printf("%10s%10s%9s%12s%12s  %s\n", "Kops/s", "huge", "speedup",
+           "dTLB/op", "huge", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.0f%10.0f%8.2fx", stats[i].ops / (stats[i].secs * 1000.0),
+               stats[i].ops / (stats[i].huge_secs * 1000.0),
+               stats[i].secs / stats[i].huge_secs);
+        if (stats[i].tlb_misses >= 0)
+            printf("%12.4f%12.4f", stats[i].tlb_misses / stats[i].ops,
+                   stats[i].huge_misses / stats[i].ops);
+        else
+            printf("%12s%12s", "-", "-");
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
+/*
+ * print_window - prints the throughput of the window of each trace
+ *    timed with -w, next to that of the whole trace
+ */
+static void print_window(int n, stats_t *stats)
+{
+    int i;
+
+    if (window_last < 0)
+        printf("\nRequests %d to the end, from a snapshot:\n", window_first);
+    else
+        printf("\nRequests %d to %d, from a snapshot:\n", window_first,
+               window_last);
+    printf("%8s%8s%8s%10s%18s%9s%10s%10s  %s\n", "first", "last", "ops",
+           "ms", "95% CI", "ns/op", "Kops/s", "whole", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%8d%8d%8d", stats[i].window_first, stats[i].window_last,
+               stats[i].window_ops);
+        if (stats[i].window_ops > 0)
+            printf("%10.3f  [%6.3f, %6.3f]%9.1f%10.0f",
+                   stats[i].window_secs * 1e3, stats[i].window_lo * 1e3,
+                   stats[i].window_hi * 1e3,
+                   1e9 * stats[i].window_secs / stats[i].window_ops,
+                   stats[i].window_ops / (stats[i].window_secs * 1000.0));
+        else
+            printf("%10s%18s%9s%10s", "-", "-", "-", "-");
+        printf("%10.0f  %s\n", stats[i].ops / (stats[i].secs * 1000.0),
+               stats[i].filename);
+    }
+}
+
+/*
+ * print_builtin_ref - prints the throughput of each trace next to that
+ *    of the built-in reference allocator (-N), and their ratio
+ */
+static void print_builtin_ref(int n, stats_t *stats)
+{
+    int i, num = 0;
+    double mm_harm = 0.0, ref_harm = 0.0;
+
+    printf("\nThroughput relative to the built-in reference:\n");
+    printf("%10s%10s%8s  %s\n", "Kops/s", "ref", "ratio", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.0f%10.0f%8.2f  %s\n", stats[i].tput, builtin_ref_tput[i],
+               stats[i].tput / builtin_ref_tput[i], stats[i].filename);
+        if (stats[i].weight == WALL || stats[i].weight == WPERF)
+        {
+            mm_harm += 1.0 / stats[i].tput;
+            ref_harm += 1.0 / builtin_ref_tput[i];
+            num++;
+        }
+    }
+    if (num > 0)
+        printf("%10.0f%10.0f%8.2f  harmonic mean\n", num / mm_harm,
+               num / ref_harm, ref_harm / mm_harm);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1798,7 +4636,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 
     errors++;
 
-    printf("ERROR [trace %s, line %d]: ", trace->filename, LINENUM(opnum));
+    printf("ERROR [trace %s, line %d]: ", trace->filename, LINENUM(trace, opnum));
     vprintf(fmt, ap);
     putchar('\n');
 
@@ -2008,6 +4846,52 @@ static double measure_ref_throughput(bool checkpoint)
     return (double)t;
 }
 
+/*
+ * measure_builtin_ref - Time the built-in reference allocator on each
+ *    trace, and return its harmonic mean throughput over the traces that
+ *    count for performance.  This is the benchmark itself, so the speed
+ *    ratios apply to the ratio of mm's throughput to it.
+ */
+static double measure_builtin_ref(int num_tracefiles, const char *tracedir,
+                                  char **tracefiles)
+{
+    int i, num = 0;
+    double harm = 0.0;
+    const allocator_t *ref = &allocators[find_allocator("ref")];
+    stats_t stats;
+    speed_t params;
+    trace_t *trace;
+
+    builtin_ref_tput = calloc(num_tracefiles, sizeof(double));
+    if (builtin_ref_tput == NULL)
+        unix_error("builtin_ref_tput calloc in measure_builtin_ref failed");
+    memset(&params, 0, sizeof(params));
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        mem_init(false);
+        if (!cmp_replay(trace, ref, NULL, NULL))
+            app_error("The built-in reference ran out of memory on %s\n",
+                      trace->filename);
+        params.trace = trace;
+        measure_once(eval_ref_speed, &params, &stats);
+        builtin_ref_tput[i] = trace->num_ops / (stats.secs * 1000.0);
+        if (stats.weight == WALL || stats.weight == WPERF)
+        {
+            harm += 1.0 / builtin_ref_tput[i];
+            num++;
+        }
+        mem_deinit();
+        free_trace(trace);
+    }
+    if (num == 0)
+        app_error("-N: no trace has a performance weight, so there is no "
+                  "throughput to compare\n");
+    if (verbose > 0)
+        printf("Built-in reference throughput %.0f Kops/s\n", num / harm);
+    return num / harm;
+}
+
 /*
  * usage - Explain the command line arguments
  */
@@ -2015,6 +4899,8 @@ static void usage(char *prog)
 {
     fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <f>[:<n>] Also replay touching fraction f of "
+                    "each payload, thinking n steps per request.\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -2028,4 +4914,43 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-B <n>     Benchmark with n samples: report median "
+                    "and confidence interval.\n");
+    fprintf(stderr, "\t-P <cpu>   Pin measurements to core <cpu>.\n");
+    fprintf(stderr, "\t-W <n>     Run n warmup iterations before sampling.\n");
+    fprintf(stderr, "\t-k <state> Cache state: hot (default), warm, cold "
+                    "or all.\n");
+    fprintf(stderr, "\t-K         Also flush the TLB in the cold state.\n");
+    fprintf(stderr, "\t-I         Report the driver's trace interpretation "
+                    "overhead.\n");
+    fprintf(stderr, "\t-b         Report allocator-only time by subtracting "
+                    "a bump allocator replay.\n");
+    fprintf(stderr, "\t-H         Also measure throughput and dTLB misses "
+                    "with huge pages.\n");
+    fprintf(stderr, "\t-E         Measure the resident and written pages of "
+                    "the heap.\n");
+    fprintf(stderr, "\t-F         Break the heap down into payload, overhead "
+                    "and free space.\n");
+    fprintf(stderr, "\t-g <n>     Write a CSV timeline of each trace's heap, "
+                    "sampled every n ops.\n");
+    fprintf(stderr, "\t-M         Profile the emulated heap accesses of "
+                    "each kind of request (mdriver-emulate).\n");
+    fprintf(stderr, "\t-R <n>     Soak: replay the traces n times on one "
+                    "heap, without resetting it.\n");
+    fprintf(stderr, "\t-w <i>[:<j>] Also time requests i to j alone, "
+                    "from a snapshot of the heap.\n");
+    fprintf(stderr, "\t-x <list>  Compare the allocators in list (mm, naive, "
+                    "libc, ref or all) side by side;\n"
+                    "\t           with -B, two are also timed "
+                    "interleaved.\n");
+    fprintf(stderr, "\t-j <n>[:part] Replay a copy of each trace, or with "
+                    "part a share of its ids, on 1 to n threads.\n");
+    fprintf(stderr, "\t-y <mode>  Replay each trace on the threads it "
+                    "records: causal or timed.\n");
+    fprintf(stderr, "\t-L <lib>   Use the malloc in thread-safe shared "
+                    "library lib (e.g. mm-mt.so) for -j and -y.\n");
+    fprintf(stderr, "\t-N         Score throughput as a ratio to the "
+                    "built-in reference allocator\n"
+                    "\t           (not comparable with scores against "
+                    "mdriver-ref).\n");
 }
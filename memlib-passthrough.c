@@ -4,53 +4,260 @@
  *
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
+ *
+ * The heap does not use the program break, which libc, a JIT or another
+ * library may move at any time.  Instead, each heap reserves MM_REGION_SIZE
+ * bytes of address space with no access, and makes them usable with
+ * mprotect MM_COMMIT_SIZE bytes at a time as the break rises.  Pages wholly
+ * above the break are given back when the heap shrinks.  When a region is
+ * full, the heap moves on to a new one, and mem_sbrk returns the start of
+ * that region rather than the old break; the allocator must then start a
+ * new run of blocks there.
+ *
+ * If the environment variable MM_HUGEPAGES is set to a nonzero value,
+ * regions are aligned to HUGE_PAGE_SIZE, committed a whole number of huge
+ * pages at a time, and marked for transparent huge pages.
  */
-#include <assert.h>
+#include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
+/* Start of each region, linking it to the heap's previous region */
+typedef struct {
+    unsigned char *prev; /* Start of the previous region, or NULL */
+    size_t prev_length;  /* Bytes still mapped there */
+} region_t;
+
+/* Bytes at the start of a region before its part of the heap */
+#define REGION_HDR round_to(sizeof(region_t), ALIGNMENT)
+
+struct mem_heap {
+    unsigned char *lo;     /* Starting address of the first region's heap */
+    unsigned char *region; /* Start of the current region */
+    unsigned char *base;   /* Start of the current region's heap */
+    unsigned char *brk;    /* Current position of break */
+    unsigned char *commit; /* End of the accessible part of the region */
+    unsigned char *end;    /* End of the region */
+    size_t prior;          /* Bytes of the heap in earlier regions */
+    size_t sbrk_calls;     /* Calls to mem_sbrk_h that grew the heap */
+    bool in_use;
+};
+
 /* private global variables */
 static bool init = false;
-static unsigned char *heap;         /* Starting address of heap */
-static unsigned char *mem_brk;      /* Current position of break */
+static bool hugepages = false;          /* Commit the heap in huge pages */
+static size_t commit_size;              /* Bytes made accessible at a time */
+static mem_heap_t heaps[MAX_MEM_HEAPS]; /* heaps[0] is the default heap */
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
-        assert(mem_brk != (void *)-1);
+        const char *env = getenv("MM_HUGEPAGES");
+        hugepages = env != NULL && atoi(env) != 0;
+        commit_size = hugepages ? HUGE_PAGE_SIZE : MM_COMMIT_SIZE;
         init = true;
     }
 }
 
-void *mem_sbrk(intptr_t incr) {
+static size_t round_to(size_t n, size_t unit) {
+    return (n + unit - 1) / unit * unit;
+}
+
+static bool commit_to(mem_heap_t *h, unsigned char *new_brk);
+
+/* Reserve a region with room for size bytes of heap, and move h to it */
+static bool new_region(mem_heap_t *h, size_t size) {
+    size_t length = MM_REGION_SIZE;
+    if (size + REGION_HDR > length) {
+        /* Leave room for the allocator to grow the new heap a little */
+        length = round_to(size + REGION_HDR + commit_size, commit_size);
+    }
+    size_t slack = hugepages ? HUGE_PAGE_SIZE : 0;
+    unsigned char *addr, *start;
+
+    addr = mmap(NULL, length + slack, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    start = addr;
+    if (hugepages) {
+        /* Trim the slack so both ends fall on huge page boundaries */
+        start = (unsigned char *)round_to((uintptr_t)addr, HUGE_PAGE_SIZE);
+        if (start > addr) {
+            munmap(addr, start - addr);
+        }
+        if (addr + slack > start) {
+            munmap(start + length, addr + slack - start);
+        }
+    }
+
+    mem_heap_t old = *h;
+    h->region = h->commit = start;
+    h->end = start + length;
+    if (!commit_to(h, start + REGION_HDR)) {
+        munmap(start, length);
+        *h = old;
+        return false;
+    }
+    h->base = h->brk = start + REGION_HDR;
+
+    region_t *hdr = (region_t *)start;
+    hdr->prev = old.region;
+    hdr->prev_length = 0;
+    if (old.region != NULL) {
+        /* Keep the used part of the old region, and free the rest */
+        h->prior += old.brk - old.base;
+        if (old.end > old.commit) {
+            munmap(old.commit, old.end - old.commit);
+        }
+        hdr->prev_length = old.commit - old.region;
+    } else {
+        h->lo = h->base;
+    }
+    return true;
+}
+
+/* Make [h->commit, new_brk) accessible, in whole commit units */
+static bool commit_to(mem_heap_t *h, unsigned char *new_brk) {
+    size_t more = round_to(new_brk - h->commit, commit_size);
+    if (h->commit + more > h->end) {
+        more = h->end - h->commit;
+    }
+    if (mprotect(h->commit, more, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    if (hugepages) {
+        madvise(h->commit, more, MADV_HUGEPAGE);
+    }
+    h->commit += more;
+    return true;
+}
+
+/* Give back the commit units wholly above the break */
+static void decommit_above(mem_heap_t *h) {
+    unsigned char *keep =
+        h->region + round_to(h->brk - h->region, commit_size);
+    if (keep < h->commit) {
+        madvise(keep, h->commit - keep, MADV_DONTNEED);
+        mprotect(keep, h->commit - keep, PROT_NONE);
+        h->commit = keep;
+    }
+}
+
+mem_heap_t *mem_heap_create(void) {
+    int i;
+    ensure_init();
+    for (i = 1; i < MAX_MEM_HEAPS && heaps[i].in_use; i++)
+        ;
+    if (i == MAX_MEM_HEAPS || !new_region(&heaps[i], 0)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    heaps[i].in_use = true;
+    return &heaps[i];
+}
+
+void mem_heap_destroy(mem_heap_t *h) {
+    unsigned char *region = h->region;
+    size_t length = h->end - h->region;
+
+    if (h == &heaps[0] || !h->in_use) {
+        return;
+    }
+    while (region != NULL) {
+        region_t hdr = *(region_t *)region;
+        munmap(region, length);
+        region = hdr.prev;
+        length = hdr.prev_length;
+    }
+    h->lo = h->region = h->base = h->brk = h->commit = h->end = NULL;
+    h->prior = 0;
+    h->sbrk_calls = 0;
+    h->in_use = false;
+}
+
+mem_heap_t *mem_default_heap(void) {
+    return &heaps[0];
+}
+
+void *mem_sbrk_h(mem_heap_t *h, intptr_t incr) {
+    unsigned char *res;
+
     ensure_init();
+    if (h->region == NULL &&
+        !new_region(h, (size_t)(incr > 0 ? incr : 0))) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    h->in_use = true;
 
-    unsigned char *res = sbrk(incr);
-    if (res == (void *)-1) {
-        return res;
+    if (incr < 0) {
+        /* Shrink within the current region only */
+        if (-incr > h->brk - h->base) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        res = h->brk;
+        h->brk += incr;
+        decommit_above(h);
+        return (void *)res;
     }
 
-    assert(res == mem_brk);
-    mem_brk += incr;
-    return (void *) res;
+    if ((size_t)incr > (size_t)(h->end - h->brk) &&
+        !new_region(h, (size_t)incr)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (h->brk + incr > h->commit && !commit_to(h, h->brk + incr)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    res = h->brk;
+    h->brk += incr;
+    h->sbrk_calls++;
+    return (void *)res;
+}
+
+void *mem_sbrk(intptr_t incr) {
+    return mem_sbrk_h(&heaps[0], incr);
+}
+
+void *mem_heap_lo_h(const mem_heap_t *h) {
+    return (void *)h->lo;
 }
 
 void *mem_heap_lo(void) {
-    ensure_init();
-    return (void *)heap;
+    return mem_heap_lo_h(&heaps[0]);
+}
+
+/* The last byte of the current region's part of the heap */
+void *mem_heap_hi_h(const mem_heap_t *h) {
+    return (void *)(h->brk - 1);
 }
 
 void *mem_heap_hi(void) {
-    ensure_init();
-    return (void *)(mem_brk - 1);
+    return mem_heap_hi_h(&heaps[0]);
+}
+
+size_t mem_heapsize_h(const mem_heap_t *h) {
+    return h->prior + (size_t)(h->brk - h->base);
 }
 
 size_t mem_heapsize(void) {
-    ensure_init();
-    return (size_t)(mem_brk - heap);
+    return mem_heapsize_h(&heaps[0]);
+}
+
+size_t mem_sbrk_calls_h(const mem_heap_t *h) {
+    return h->sbrk_calls;
+}
+
+size_t mem_sbrk_calls(void) {
+    return mem_sbrk_calls_h(&heaps[0]);
 }
 
 size_t mem_pagesize(void) {
@@ -14,9 +14,19 @@
  * map(emulated address / PAGE_SIZE) -> mem_block_t
  * map(mem_block_t, emulated address % PAGE_SIZE) -> byte(s)
  *
+ * The first map is an open-addressed hash table, grown to stay at most
+ *  HASH_LOAD full, fronted by a small direct-mapped cache of recent lookups.
+ *  Pages come from a pool that grows one mapping at a time as needed, up
+ *  to MAX_SPARSE_POOL bytes.
+ *
+ * Pages that have never been written, or were last written entirely with
+ *  zeros, are absent from the table and read as a shared zero page.  A
+ *  write to such a page gives it its own storage.
+ *
  * This mapping is for a single address; however, accesses can span two blocks
  *  so the mapping sequence checks accounts for size and can perform two
- *  lookups if necessary.
+ *  lookups if necessary.  Aligned 8-byte accesses never span two blocks and
+ *  take a shorter path.
  *
  * Storing in the sparse emulation goes through the above lookup process and
  *  then memcpy's the bytes into the block.
@@ -57,30 +67,75 @@ void markGlobalsUninit(void);
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
-    size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
+    size_t id; /* Page ID.  Counts number of pages from start of heap */
     unsigned char initSet[SPARSE_PAGE_SIZE / 8];
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* One mapping of pages for the pool */
+typedef struct POOL
+{
+    struct POOL *next; /* Next mapping, in the order they were made */
+    size_t used;       /* Number of pages handed out */
+    mem_block_t pages[SPARSE_POOL_CHUNK];
+    uint64_t padding; /* Room for 8-byte reads near the end of a page */
+} pool_chunk_t;
+
+/* Entry in the cache of page table lookups */
+typedef struct
+{
+    size_t id;
+    mem_block_t *block; /* NULL if the entry is empty */
+} page_cache_t;
+
+/* A region reserved for the dense heap */
+typedef struct
+{
+    unsigned char *base; /* Start of the region, or NULL if not reserved */
+    unsigned char *peak; /* Highest break since pages were last released */
+    bool stale;          /* Does the region hold pages of an old trace? */
+} dense_region_t;
+
+/* A heap, grown by mem_sbrk_h */
+struct mem_heap
+{
+    unsigned char *lo;       /* Starting address of heap */
+    unsigned char *brk;      /* Current position of break */
+    unsigned char *max_addr; /* Maximum allowable heap address */
+    dense_region_t region;   /* Region reserved for a dense extra heap */
+    size_t sbrk_calls;       /* Successful mem_sbrk_h calls since reset */
+    bool in_use;
+};
+
 /* private global variables */
-static bool sparse = false;         /* Use sparse memory emulation */
-static unsigned char *heap;         /* Starting address of heap */
-static unsigned char *mem_brk;      /* Current position of break */
-static unsigned char *mem_max_addr; /* Maximum allowable heap address */
-static size_t mmap_length =
-    MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static bool sparse = false; /* Use sparse memory emulation */
+static mem_heap_t heaps[MAX_MEM_HEAPS]; /* heaps[0] is the default heap */
+static mem_heap_t *const def_heap = &heaps[0];
+static int num_heaps = 1; /* One more than the highest heap in use */
+static dense_region_t dense_regions[2]; /* Default heap, normal and huge */
+static dense_region_t *dense = &dense_regions[0]; /* Region in use */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
+static mem_access_fn profiler = NULL; /* Told of each emulated access */
 
 /* Sparse memory representation */
-static mem_block_t *next_free_page = NULL; /* Next free page */
-static size_t num_pages = 0;               /* Total number of pages */
-static size_t num_free_pages = 0;          /* Number of free pages */
-static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static pool_chunk_t *pool_head = NULL;  /* First mapping of pages */
+static pool_chunk_t *pool_cur = NULL;   /* Mapping pages are taken from */
+static size_t pool_chunks = 0;          /* Number of mappings */
+static mem_block_t *free_pages = NULL;  /* Pages given back to the pool */
+static size_t num_pages = 0;            /* Number of pages in use */
+static mem_block_t **page_table = NULL; /* Hash table from page ID to page */
+static size_t num_buckets = 0;          /* Number of buckets in page table */
+static size_t num_entries = 0;          /* Number of pages in page table */
+static int bucket_bits = 0;             /* log2(num_buckets) */
+static page_cache_t page_cache[SPARSE_PAGE_CACHE]; /* Recent lookups */
+static struct
+{
+    mem_block_t page;
+    uint64_t padding;
+} zero_page; /* Contents of every absent page */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -113,8 +168,32 @@ const char *__msan_default_options()
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void *get_span(const void *addr, size_t, bool);
+static void *map_anon(size_t length);
+static void reserve_dense(dense_region_t *region, bool huge);
+static void drop_heap_pages(const mem_heap_t *h);
+static void clear_pages(void);
+static void drop_page(size_t id);
 static void print_stats();
 
+/* Is [addr, addr + len) within an emulated heap? */
+static inline bool in_sparse_heap(const void *addr, size_t len)
+{
+    const unsigned char *lo = addr;
+    int i;
+
+    if (!sparse)
+        return false;
+    if (lo >= def_heap->lo && lo + len <= def_heap->brk)
+        return true;
+    for (i = 1; i < num_heaps; i++)
+    {
+        if (heaps[i].in_use && lo >= heaps[i].lo && lo + len <= heaps[i].brk)
+            return true;
+    }
+    return false;
+}
+
 /*
  * mem_init - initialize the memory system model
  */
@@ -123,69 +202,129 @@ void mem_init(bool do_sparse)
     sparse = do_sparse;
     if (sparse)
     {
-        /* Want sparse total allocation to approximately match the dense heap
-         * size */
-        /* Account for both page itself and its amortized contribution to the
-         * page table */
-        double fbytes_per_page =
-            sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
-        num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = num_pages / HASH_LOAD;
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
-                      num_pages * sizeof(mem_block_t) +     // Pages
-                      sizeof(uint64_t);                     // Padding
+        /* Start with a small page table and no pages; both grow on demand */
+        bucket_bits = SPARSE_TABLE_BITS;
+        num_buckets = (size_t)1 << bucket_bits;
+        page_table = map_anon(num_buckets * sizeof(mem_block_t *));
+        clear_pages();
+        def_heap->lo = SPARSE_HEAP_START;
+        def_heap->max_addr = def_heap->lo + MAX_SPARSE_HEAP;
         setUBCheck(true);
     }
     else
     {
-        /* Dense allocation */
-        next_free_page = NULL;
+        /*
+         * Dense allocation.  Regions are reserved once and kept for every
+         * later trace; what the last trace touched is released by the
+         * next mem_reset_brk.
+         */
+        dense_regions[0].stale = dense_regions[0].base != NULL;
+        dense_regions[1].stale = dense_regions[1].base != NULL;
+        if (!dense->base)
+            reserve_dense(dense, dense == &dense_regions[1]);
+        def_heap->lo = dense->base;
+        def_heap->max_addr = def_heap->lo + MAX_DENSE_HEAP;
+    }
+    stats_printed = false;
+    def_heap->brk = def_heap->lo;
+    def_heap->sbrk_calls = 0;
+    def_heap->in_use = true;
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void)
+{
+    int i;
+    print_stats();
+    for (i = 1; i < num_heaps; i++)
+    {
+        if (heaps[i].in_use)
+            mem_heap_destroy(&heaps[i]);
+    }
+    if (sparse)
+    {
+        while (pool_head)
+        {
+            pool_chunk_t *next = pool_head->next;
+            munmap(pool_head, sizeof(pool_chunk_t));
+            pool_head = next;
+        }
+        munmap(page_table, num_buckets * sizeof(mem_block_t *));
+        pool_cur = NULL;
+        pool_chunks = 0;
+        free_pages = NULL;
         num_pages = 0;
         page_table = NULL;
         num_buckets = 0;
-        mmap_length = MAX_DENSE_HEAP;
+        num_entries = 0;
     }
+    else if (def_heap->brk > dense->peak)
+        dense->peak = def_heap->brk;
+}
 
-    int dev_zero = open("/dev/zero", O_RDWR);
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
-    if (addr == MAP_FAILED)
+/*
+ * mem_heap_create - make a new, empty heap, with its own reserved region
+ *    when dense and its own address window when sparse.  Returns NULL
+ *    if there are already MAX_MEM_HEAPS heaps.
+ */
+mem_heap_t *mem_heap_create(void)
+{
+    mem_heap_t *h;
+    int i;
+
+    for (i = 1; i < MAX_MEM_HEAPS && heaps[i].in_use; i++)
+        ;
+    if (i == MAX_MEM_HEAPS)
     {
-        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
-        exit(1);
+        errno = ENOMEM;
+        return NULL;
     }
+    h = &heaps[i];
     if (sparse)
     {
-        /* Use initial space for page table */
-        page_table = (mem_block_t **)addr;
-        heap = SPARSE_HEAP_START;
-        mem_max_addr = heap + MAX_SPARSE_HEAP;
+        /* Windows are stacked downward from the default heap */
+        h->lo = (unsigned char *)SPARSE_HEAP_START -
+                (size_t)i * SPARSE_WINDOW_SIZE;
+        h->max_addr = h->lo + SPARSE_WINDOW_SIZE;
     }
     else
     {
-        heap = addr;
-        mem_max_addr = heap + MAX_DENSE_HEAP;
+        reserve_dense(&h->region, dense == &dense_regions[1]);
+        h->lo = h->region.base;
+        h->max_addr = h->lo + MAX_DENSE_HEAP;
     }
-    stats_printed = false;
-    mem_brk = heap;
+    h->in_use = true;
+    if (i >= num_heaps)
+        num_heaps = i + 1;
+    mem_reset_brk_h(h);
+    return h;
 }
 
 /*
- * mem_deinit - free the storage used by the memory system model
+ * mem_heap_destroy - free a heap made by mem_heap_create, along with
+ *    its contents
  */
-void mem_deinit(void)
+void mem_heap_destroy(mem_heap_t *h)
 {
-    print_stats();
-    munmap(heap, mmap_length);
-    next_free_page = NULL;
-    num_free_pages = 0;
-    page_table = NULL;
-    num_buckets = 0;
+    if (h == def_heap || !h->in_use)
+        return;
+    if (sparse)
+        drop_heap_pages(h);
+    else
+        munmap(h->lo, MAX_DENSE_HEAP);
+    h->in_use = false;
+    while (num_heaps > 1 && !heaps[num_heaps - 1].in_use)
+        num_heaps--;
+}
+
+/*
+ * mem_default_heap - return the heap used by mem_sbrk and friends
+ */
+mem_heap_t *mem_default_heap(void)
+{
+    return def_heap;
 }
 
 /*
@@ -193,31 +332,75 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
-    print_stats();
+    mem_reset_brk_h(def_heap);
+}
+
+void mem_reset_brk_h(mem_heap_t *h)
+{
+    if (h == def_heap)
+        print_stats();
     if (sparse)
     {
-        /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
-        memset((void *)page_table, 0, ptb);
-        /* First page is just beyond page table */
-        next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
-        num_free_pages = num_pages;
+        if (num_heaps == 1)
+            clear_pages();
+        else
+            drop_heap_pages(h);
     }
     else
     {
+        if (h == def_heap)
+        {
+            if (h->brk > dense->peak)
+                dense->peak = h->brk;
+            if (dense->stale)
+            {
+                /*
+                 * Give back the pages the previous trace touched, so this
+                 * one starts from zeroed memory.  Only the first reset of
+                 * a trace does this, which is before any timing.
+                 */
+                madvise(h->lo, dense->peak - h->lo, MADV_DONTNEED);
+                dense->peak = h->lo;
+                dense->stale = false;
+            }
+        }
 #ifdef USE_ASAN
         /* Mark the entire heap as unaddressable */
-        __asan_poison_memory_region(heap, MAX_DENSE_HEAP);
+        __asan_poison_memory_region(h->lo, MAX_DENSE_HEAP);
 #endif
 #ifdef USE_MSAN
         /* Mark global variables as uninitialized */
         markGlobalsUninit();
 
         /* Mark heap as uninitialized (though payloads may be overwritten by driver!) */
-        __msan_allocated_memory(heap, MAX_DENSE_HEAP);
+        __msan_allocated_memory(h->lo, MAX_DENSE_HEAP);
 #endif
     }
-    mem_brk = heap;
+    h->brk = h->lo;
+    h->sbrk_calls = 0;
+}
+
+/*
+ * mem_set_hugepages - back the dense heap with huge pages, or not.  Takes
+ *    effect at once, leaving an empty heap, or at the next mem_init.
+ *    Heaps made by mem_heap_create afterwards get the same backing.
+ */
+void mem_set_hugepages(bool on)
+{
+    if (sparse || !def_heap->in_use)
+    {
+        dense = &dense_regions[on];
+        return;
+    }
+    if (def_heap->brk > dense->peak)
+        dense->peak = def_heap->brk;
+    dense = &dense_regions[on];
+    if (!dense->base)
+        reserve_dense(dense, on);
+    def_heap->lo = dense->base;
+    def_heap->max_addr = def_heap->lo + MAX_DENSE_HEAP;
+    def_heap->brk = def_heap->lo;
+    def_heap->sbrk_calls = 0;
 }
 
 /*
@@ -227,7 +410,12 @@ void mem_reset_brk()
  */
 void *mem_sbrk(intptr_t incr)
 {
-    unsigned char *old_brk = mem_brk;
+    return mem_sbrk_h(def_heap, incr);
+}
+
+void *mem_sbrk_h(mem_heap_t *h, intptr_t incr)
+{
+    unsigned char *old_brk = h->brk;
 
     bool ok = true;
     if (incr < 0)
@@ -238,30 +426,24 @@ void *mem_sbrk(intptr_t incr)
                 "value %ld\n",
                 (long)incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (h->brk + incr > h->max_addr)
     {
         ok = false;
-        size_t alloc = mem_brk - heap + incr;
+        size_t alloc = h->brk - h->lo + incr;
         fprintf(stderr,
                 "ERROR: mem_sbrk failed. Ran out of memory.  Would require "
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
-    {
-        ok = false;
-        fprintf(
-            stderr,
-            "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
-    }
 
     if (ok)
     {
 #ifdef USE_ASAN
         /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, incr);
+        __asan_unpoison_memory_region(h->brk, incr);
 #endif
-        mem_brk += incr;
+        h->brk += incr;
+        h->sbrk_calls++;
         return (void *)old_brk;
     }
     else
@@ -276,7 +458,12 @@ void *mem_sbrk(intptr_t incr)
  */
 void *mem_heap_lo()
 {
-    return (void *)heap;
+    return (void *)def_heap->lo;
+}
+
+void *mem_heap_lo_h(const mem_heap_t *h)
+{
+    return (void *)h->lo;
 }
 
 /*
@@ -284,7 +471,12 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(def_heap->brk - 1);
+}
+
+void *mem_heap_hi_h(const mem_heap_t *h)
+{
+    return (void *)(h->brk - 1);
 }
 
 /*
@@ -292,7 +484,101 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize()
 {
-    return (size_t)(mem_brk - heap);
+    return (size_t)(def_heap->brk - def_heap->lo);
+}
+
+size_t mem_heapsize_h(const mem_heap_t *h)
+{
+    return (size_t)(h->brk - h->lo);
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of times mem_sbrk has grown the
+ *    heap since it was last reset
+ */
+size_t mem_sbrk_calls()
+{
+    return def_heap->sbrk_calls;
+}
+
+size_t mem_sbrk_calls_h(const mem_heap_t *h)
+{
+    return h->sbrk_calls;
+}
+
+/*
+ * mem_release_heap - empty the default heap like mem_reset_brk, and give
+ *    all of its pages back to the system, so that none are resident
+ */
+void mem_release_heap()
+{
+    mem_reset_brk();
+    if (!sparse && dense->peak > def_heap->lo)
+    {
+        madvise(def_heap->lo, dense->peak - def_heap->lo, MADV_DONTNEED);
+        dense->peak = def_heap->lo;
+    }
+}
+
+/* Pagemap entry bits: page present, soft-dirty, mapped only by us */
+#define PM_PRESENT (1UL << 63)
+#define PM_SOFT_DIRTY (1UL << 55)
+#define PM_EXCLUSIVE (1UL << 56)
+#define PAGEMAP_BATCH 512 /* entries read at a time */
+
+/*
+ * mem_heap_residency - count the bytes in the pages of the dense heap,
+ *    up to the break, that are resident and that have been written.
+ *    Pages that have only been read map the shared zero page, so the
+ *    written ones are those /proc/self/pagemap shows as soft-dirty or
+ *    mapped by this process alone.  If pagemap can't be read, counts
+ *    the resident pages with mincore, and returns false to say that
+ *    written pages can't be told apart.
+ */
+bool mem_heap_residency(size_t *resident, size_t *written)
+{
+    size_t page = mem_pagesize();
+    uintptr_t first = (uintptr_t)def_heap->lo / page;
+    size_t npages = ((size_t)(def_heap->brk - def_heap->lo) + page - 1) / page;
+    uint64_t entries[PAGEMAP_BATCH];
+    size_t i, n, done;
+    int fd;
+
+    *resident = *written = 0;
+    if (sparse || npages == 0)
+        return true;
+    if ((fd = open("/proc/self/pagemap", O_RDONLY)) < 0)
+    {
+        unsigned char *vec = malloc(npages);
+        if (vec == NULL || mincore(def_heap->lo, npages * page, vec) != 0)
+        {
+            free(vec);
+            return false;
+        }
+        for (i = 0; i < npages; i++)
+            *resident += (vec[i] & 1) * page;
+        *written = *resident;
+        free(vec);
+        return false;
+    }
+    for (done = 0; done < npages; done += n)
+    {
+        n = npages - done < PAGEMAP_BATCH ? npages - done : PAGEMAP_BATCH;
+        if (pread(fd, entries, n * sizeof(uint64_t),
+                  (off_t)((first + done) * sizeof(uint64_t))) !=
+            (ssize_t)(n * sizeof(uint64_t)))
+            break;
+        for (i = 0; i < n; i++)
+        {
+            if (!(entries[i] & PM_PRESENT))
+                continue;
+            *resident += page;
+            if (entries[i] & (PM_SOFT_DIRTY | PM_EXCLUSIVE))
+                *written += page;
+        }
+    }
+    close(fd);
+    return true;
 }
 
 /*
@@ -305,6 +591,15 @@ size_t mem_pagesize()
 
 /*************** Memory emulation  *******************/
 
+/*
+ * mem_set_profiler - report each emulated heap access to fn from now on,
+ *    or stop reporting if fn is NULL
+ */
+void mem_set_profiler(mem_access_fn fn)
+{
+    profiler = fn;
+}
+
 __int128 mem_read128(const void *addr)
 {
     __int128 r;
@@ -323,9 +618,14 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (in_sparse_heap(addr, len))
     {
+        if (profiler)
+            profiler(addr, len, false);
+        /* Aligned 8-byte reads stay within one page */
+        if (len == sizeof(uint64_t) && ((uintptr_t)addr & 0x7) == 0)
+            return *(uint64_t *)get_mem(addr, len, false);
+
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -367,9 +667,17 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (in_sparse_heap(addr, len))
     {
+        if (profiler)
+            profiler(addr, len, true);
+        /* Aligned 8-byte writes stay within one page */
+        if (len == sizeof(uint64_t) && ((uintptr_t)addr & 0x7) == 0)
+        {
+            *(uint64_t *)get_mem(addr, len, true) = val;
+            return;
+        }
+
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -410,11 +718,49 @@ void mem_write(void *addr, uint64_t val, size_t len)
     }
 }
 
+/* Number of bytes from addr to the end of its emulated page */
+static size_t page_room(const void *addr)
+{
+    size_t offset = (unsigned char *)addr - (unsigned char *)SPARSE_HEAP_START;
+    return SPARSE_PAGE_SIZE - offset % SPARSE_PAGE_SIZE;
+}
+
 /* Emulation of memcpy */
 void *mem_memcpy(void *dst, const void *src, size_t num_bytes)
 {
     void *savedst = dst;
     size_t word_size = sizeof(uint64_t);
+
+    if (in_sparse_heap(dst, num_bytes) && in_sparse_heap(src, num_bytes))
+    {
+        /* Copy one span at a time, split at page boundaries on both sides */
+        while (num_bytes > 0)
+        {
+            size_t len = num_bytes;
+            if (len > page_room(dst))
+                len = page_room(dst);
+            if (len > page_room(src))
+                len = page_room(src);
+            if (profiler)
+            {
+                profiler(src, len, false);
+                profiler(dst, len, true);
+            }
+            const void *s = get_span(src, len, false);
+#ifdef NO_CHECK_UB
+            if (s == zero_page.page.bytes && len == SPARSE_PAGE_SIZE)
+                /* Copying a whole absent page leaves an absent page */
+                drop_page(page_id(dst));
+            else
+#endif
+                memmove(get_span(dst, len, true), s, len);
+            num_bytes -= len;
+            src = (void *)((unsigned char *)src + len);
+            dst = (void *)((unsigned char *)dst + len);
+        }
+        return savedst;
+    }
+
     while (num_bytes >= word_size)
     {
         uint64_t data = mem_read(src, word_size);
@@ -443,6 +789,30 @@ void *mem_memset(void *dst, int c, size_t num_bytes)
     {
         data = data | (byte << (8 * i));
     }
+
+    if (in_sparse_heap(dst, num_bytes))
+    {
+        /* Set one page at a time */
+        while (num_bytes > 0)
+        {
+            size_t len = num_bytes;
+            if (len > page_room(dst))
+                len = page_room(dst);
+            if (profiler)
+                profiler(dst, len, true);
+#ifdef NO_CHECK_UB
+            if (c == 0 && len == SPARSE_PAGE_SIZE)
+                /* A page of zeros reads the same as an absent page */
+                drop_page(page_id(dst));
+            else
+#endif
+                memset(get_span(dst, len, true), c, len);
+            num_bytes -= len;
+            dst = (void *)((unsigned char *)dst + len);
+        }
+        return savedst;
+    }
+
     while (num_bytes >= word_size)
     {
         mem_write(dst, data, word_size);
@@ -494,17 +864,16 @@ static void print_stats()
         return;
     if (sparse)
     {
-        size_t ppages = num_pages - num_free_pages;
-        size_t pbytes = ppages * SPARSE_PAGE_SIZE;
+        size_t pbytes = num_pages * SPARSE_PAGE_SIZE;
         printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
                "(%.4f%% density).  Max address = %p\n",
-               ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes,
-               mem_brk);
+               num_pages, pool_chunks * SPARSE_POOL_CHUNK, pbytes, vbytes,
+               100.0 * pbytes / vbytes, def_heap->brk);
     }
     else
     {
         printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
-               mem_brk);
+               def_heap->brk);
     }
     stats_printed = true;
 }
@@ -523,38 +892,291 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
-/* Get memory to store value.  Allocate page if necessary */
-static void *get_mem(const void *addr, size_t size, bool isWrite)
+/* Map length bytes of zeroed memory, or fail */
+static void *map_anon(size_t length)
 {
-    size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
+        exit(1);
+    }
+    return addr;
+}
+
+/* Are transparent huge pages enabled, at least on request? */
+static bool thp_enabled(void)
+{
+    char buf[64] = "";
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (fp == NULL)
+        return false;
+    if (fgets(buf, sizeof(buf), fp) == NULL)
+        buf[0] = '\0';
+    fclose(fp);
+    return strstr(buf, "[never]") == NULL && buf[0] != '\0';
+}
+
+/*
+ * Reserve MAX_DENSE_HEAP bytes for the dense heap, near
+ *  TRY_DENSE_HEAP_START.  A huge page region is aligned to HUGE_PAGE_SIZE
+ *  and marked for transparent huge pages.  When those are disabled, it is
+ *  taken from the hugetlb pool instead if one is configured, or else left
+ *  with normal pages.
+ */
+static void reserve_dense(dense_region_t *region, bool huge)
+{
+    size_t slack = huge ? HUGE_PAGE_SIZE : 0;
+    unsigned char *addr, *start;
+    addr = mmap(TRY_DENSE_HEAP_START,   /* suggested start*/
+                MAX_DENSE_HEAP + slack, /* length */
+                PROT_READ | PROT_WRITE, /* permissions */
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
+                -1,                                          /* fd */
+                0);                                          /* offset */
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
+        exit(1);
+    }
+    start = addr;
+    if (huge)
+    {
+        /* Trim the slack so both ends fall on huge page boundaries */
+        start = (unsigned char *)(((uintptr_t)addr + HUGE_PAGE_SIZE - 1) &
+                                  ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (start > addr)
+            munmap(addr, start - addr);
+        if (addr + slack > start)
+            munmap(start + MAX_DENSE_HEAP, addr + slack - start);
+
+        if (!thp_enabled() || madvise(start, MAX_DENSE_HEAP, MADV_HUGEPAGE))
+        {
+            /* Without MAP_NORESERVE, this fails unless the pool has room */
+            void *tlb = mmap(start, MAX_DENSE_HEAP, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (tlb != MAP_FAILED)
+            {
+                munmap(start, MAX_DENSE_HEAP);
+                start = tlb;
+            }
+            else
+                fprintf(stderr, "WARNING.  No huge pages available; using "
+                                "normal pages for heap\n");
+        }
+    }
+    region->base = region->peak = start;
+    region->stale = false;
+}
+
+/* Empty the page table and the lookup cache, and return all pages */
+static void clear_pages(void)
+{
+    pool_chunk_t *chunk;
+
+    memset((void *)page_table, 0, num_buckets * sizeof(mem_block_t *));
+    memset(page_cache, 0, sizeof(page_cache));
+    for (chunk = pool_head; chunk; chunk = chunk->next)
+        chunk->used = 0;
+    pool_cur = pool_head;
+    free_pages = NULL;
+    num_pages = 0;
+    num_entries = 0;
+}
+
+/* Take a page from the free list or the pool, mapping more if necessary */
+static mem_block_t *alloc_page(void)
+{
+    mem_block_t *block;
+
+    if (free_pages)
+    {
+        block = free_pages;
+        free_pages = *(mem_block_t **)block->bytes;
+    }
+    else
+    {
+        while (pool_cur && pool_cur->used == SPARSE_POOL_CHUNK)
+            pool_cur = pool_cur->next;
+        if (!pool_cur)
+        {
+            if ((pool_chunks + 1) * sizeof(pool_chunk_t) > MAX_SPARSE_POOL)
+            {
+                /*
+                 * This will often fail due to student code that either
+                 *  accesses too many memory locations, such as checking
+                 *  every byte in a block.  Or more commonly due to poor
+                 *  utilization, such as leaking or not finding the huge
+                 *  allocations.
+                 */
+                fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
+                exit(1);
+            }
+            /* Append a new mapping to the pool */
+            pool_cur = map_anon(sizeof(pool_chunk_t));
+            if (pool_head)
+            {
+                pool_chunk_t *last = pool_head;
+                while (last->next)
+                    last = last->next;
+                last->next = pool_cur;
+            }
+            else
+                pool_head = pool_cur;
+            pool_chunks++;
+        }
+        block = &pool_cur->pages[pool_cur->used++];
+    }
+    num_pages++;
+    return block;
+}
+
+/* Index of the page table bucket holding id, or the empty one ending its run */
+static size_t find_bucket(size_t id)
+{
+    /* Fibonacci hashing, then linear probing from there */
+    size_t b = (id * 0x9E3779B97F4A7C15UL) >> (64 - bucket_bits);
+    mem_block_t *block;
+
+    while ((block = page_table[b]) && block->id != id)
+        b = (b + 1) & (num_buckets - 1);
+    return b;
+}
+
+/* Double the size of the page table */
+static void grow_table(void)
+{
+    mem_block_t **old_table = page_table;
+    size_t old_buckets = num_buckets;
+    size_t b;
+
+    bucket_bits++;
+    num_buckets = (size_t)1 << bucket_bits;
+    page_table = map_anon(num_buckets * sizeof(mem_block_t *));
+    for (b = 0; b < old_buckets; b++)
+        if (old_table[b])
+            page_table[find_bucket(old_table[b]->id)] = old_table[b];
+    munmap(old_table, old_buckets * sizeof(mem_block_t *));
+}
+
+/*
+ * Find the page with a given ID in the page table.  If it is absent, then
+ *  for a read return the zero page, and for a write allocate the page.
+ */
+static mem_block_t *find_page(size_t id, bool isWrite)
+{
+    mem_block_t *block;
+    size_t b = find_bucket(id);
     unsigned int i;
 
+    if ((block = page_table[b]) || !isWrite)
+        return block ? block : &zero_page.page;
+
+    /* Need to allocate a new block */
+    if (num_entries + 1 > num_buckets * HASH_LOAD)
+    {
+        grow_table();
+        b = find_bucket(id);
+    }
+    block = alloc_page();
+    block->id = id;
+    for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
+        block->initSet[i] = 0;
+    memset(block->bytes, 0, SPARSE_PAGE_SIZE);
+    page_table[b] = block;
+    num_entries++;
+    return block;
+}
+
+/*
+ * Remove the page with a given ID from the page table, so that it reads
+ *  as zeros again, and return its storage to the pool
+ */
+static void drop_page(size_t id)
+{
+    size_t b = find_bucket(id);
+    size_t next, home;
     mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
+
     if (!block)
+        return;
+    page_cache[id % SPARSE_PAGE_CACHE].block = NULL;
+
+    /* Shift later entries of the probe run back into the hole */
+    for (next = (b + 1) & (num_buckets - 1); page_table[next];
+         next = (next + 1) & (num_buckets - 1))
     {
-        /* Need to allocate a new block */
-        if (num_free_pages == 0)
+        home = (page_table[next]->id * 0x9E3779B97F4A7C15UL) >>
+               (64 - bucket_bits);
+        if (((next - home) & (num_buckets - 1)) >=
+            ((next - b) & (num_buckets - 1)))
         {
-            /*
-             * This will often fail due to student code that either accesses
-             *  too many memory locations, such as checking every byte in a
-             *  block.  Or more commonly due to poor utilization, such as
-             *  leaking or not finding the huge allocations.
-             */
-            fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
-            exit(1);
+            page_table[b] = page_table[next];
+            b = next;
         }
-        block = next_free_page++;
-        num_free_pages--;
-        block->id = id;
-        block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
-        page_table[b] = block;
     }
+    page_table[b] = NULL;
+    num_entries--;
+
+    *(mem_block_t **)block->bytes = free_pages;
+    free_pages = block;
+    num_pages--;
+}
+
+/* Drop every page of heap h, leaving those of the other heaps */
+static void drop_heap_pages(const mem_heap_t *h)
+{
+    size_t first = page_id(h->lo);
+    size_t span = (h->brk - h->lo + SPARSE_PAGE_SIZE - 1) / SPARSE_PAGE_SIZE;
+    size_t id, b;
+
+    if (span <= num_entries)
+    {
+        for (id = first; id != first + span; id++)
+            drop_page(id);
+        return;
+    }
+    /*
+     * Deletion shifts later entries back into the hole, so look at a
+     *  bucket again after dropping its page.  Entries that wrap around to
+     *  buckets already seen were seen before, and kept.
+     */
+    for (b = 0; b < num_buckets;)
+    {
+        mem_block_t *block = page_table[b];
+        if (block && block->id - first < span)
+            drop_page(block->id);
+        else
+            b++;
+    }
+}
+
+/*
+ * Find the page with a given ID, trying the lookup cache first.  Reads of
+ *  absent pages are cached too, and must not satisfy a write.
+ */
+static mem_block_t *lookup_page(size_t id, bool isWrite)
+{
+    page_cache_t *entry = &page_cache[id % SPARSE_PAGE_CACHE];
+
+    if (!entry->block || entry->id != id ||
+        (isWrite && entry->block == &zero_page.page))
+    {
+        entry->block = find_page(id, isWrite);
+        entry->id = id;
+    }
+    return entry->block;
+}
+
+/* Get memory to store value.  Allocate page if necessary */
+static void *get_mem(const void *addr, size_t size, bool isWrite)
+{
+    size_t id = page_id(addr);
+    mem_block_t *block = lookup_page(id, isWrite);
+#ifndef NO_CHECK_UB
+    unsigned int i;
+#endif
 
     // Convert an emulated address into an offset
     void *saddr = page_start(id);
@@ -599,3 +1221,77 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
 
     return (void *)&block->bytes[offset];
 }
+
+#ifndef NO_CHECK_UB
+/* Mark len bytes of a page starting at offset as initialized */
+static void init_span(mem_block_t *block, size_t offset, size_t len)
+{
+    size_t end = offset + len;
+
+    /* Bits up to the first whole byte of the bit vector, */
+    while (offset < end && (offset & 0x7) != 0)
+    {
+        block->initSet[offset / 8] |= (0x1 << (offset & 0x7));
+        offset++;
+    }
+    /* then whole bytes, */
+    if (end - offset >= 8)
+    {
+        memset(&block->initSet[offset / 8], 0xFF, (end - offset) / 8);
+        offset += (end - offset) & ~(size_t)0x7;
+    }
+    /* and the rest */
+    for (; offset < end; offset++)
+        block->initSet[offset / 8] |= (0x1 << (offset & 0x7));
+}
+
+/* Return the number of initialized bytes at offset, up to len */
+static size_t init_prefix(const mem_block_t *block, size_t offset, size_t len)
+{
+    size_t i = 0, o;
+
+    while (i < len)
+    {
+        o = offset + i;
+        /* Skip whole bytes of the bit vector at a time */
+        if ((o & 0x7) == 0 && len - i >= 8 && block->initSet[o / 8] == 0xFF)
+            i += 8;
+        else if ((block->initSet[o / 8] & (0x1 << (o & 0x7))) != 0)
+            i++;
+        else
+            break;
+    }
+    return i;
+}
+#endif
+
+/*
+ * Get memory for len bytes at addr, which must not cross a page boundary,
+ *  and update the initialization bit vector for the whole span at once.
+ */
+static void *get_span(const void *addr, size_t len, bool isWrite)
+{
+    size_t id = page_id(addr);
+    mem_block_t *block = lookup_page(id, isWrite);
+    size_t offset = (unsigned char *)addr - (unsigned char *)page_start(id);
+
+#ifndef NO_CHECK_UB
+    if (isWrite)
+        init_span(block, offset, len);
+    else if (checkUB)
+    {
+        size_t i = init_prefix(block, offset, len);
+        if (i < len)
+        {
+            // See get_mem
+            fprintf(stderr,
+                    "Attempt to read uninitialized address %p, see %s:%d for "
+                    "details\n",
+                    ((unsigned char *)addr + i), __FILE__, __LINE__);
+            abort();
+        }
+    }
+#endif
+
+    return (void *)&block->bytes[offset];
+}
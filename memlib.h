@@ -10,6 +10,13 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/**
+ * @brief A heap: a contiguous region that grows with mem_sbrk_h.
+ *
+ * The functions without a heap argument work on the default heap.
+ */
+typedef struct mem_heap mem_heap_t;
+
 /**
  * @brief
  * @param[in] sparse
@@ -21,6 +28,39 @@ void mem_init(bool sparse);
  */
 void mem_deinit(void);
 
+/**
+ * @brief Selects whether the dense heap is backed by huge pages.
+ *
+ * If the memory system is initialized, the heap is emptied and moved to a
+ * region with the requested backing; otherwise the choice applies from the
+ * next call to mem_init.  Has no effect in sparse emulation.
+ *
+ * @param[in] on Use huge pages
+ */
+void mem_set_hugepages(bool on);
+
+/**
+ * @brief Makes a new, empty heap alongside the default one.
+ *
+ * In dense mode, each heap has its own reserved region; in sparse mode, its
+ * own address window.  All heaps but the default are destroyed by
+ * mem_deinit.
+ *
+ * @return The new heap, or NULL if MAX_MEM_HEAPS heaps already exist
+ */
+mem_heap_t *mem_heap_create(void);
+
+/**
+ * @brief Frees a heap made by mem_heap_create, along with its contents.
+ * @param[in] h The heap
+ */
+void mem_heap_destroy(mem_heap_t *h);
+
+/**
+ * @brief Returns the heap used by mem_sbrk, mem_heap_lo and the like.
+ */
+mem_heap_t *mem_default_heap(void);
+
 /**
  * @brief Extends the heap by incr bytes.
  *
@@ -34,16 +74,27 @@ void mem_deinit(void);
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Extends heap h by incr bytes, like mem_sbrk.
+ */
+void *mem_sbrk_h(mem_heap_t *h, intptr_t incr);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
 void mem_reset_brk(void);
 
+/**
+ * @brief Empties heap h, like mem_reset_brk.
+ */
+void mem_reset_brk_h(mem_heap_t *h);
+
 /**
  * @brief Finds the low address of the heap.
  * @return The address of the first valid byte in the heap.
  */
 void *mem_heap_lo(void);
+void *mem_heap_lo_h(const mem_heap_t *h);
 
 /**
  * @brief Finds the high address of the heap.
@@ -54,12 +105,41 @@ void *mem_heap_lo(void);
  * @return The address of the last valid byte in the heap.
  */
 void *mem_heap_hi(void);
+void *mem_heap_hi_h(const mem_heap_t *h);
 
 /**
  * @brief Returns the number of bytes being used by the heap.
  * @return The size of the heap, in bytes
  */
 size_t mem_heapsize(void);
+size_t mem_heapsize_h(const mem_heap_t *h);
+
+/**
+ * @brief Counts the calls to mem_sbrk that have grown the heap.
+ * @return The number of successful calls since the heap was last reset
+ */
+size_t mem_sbrk_calls(void);
+size_t mem_sbrk_calls_h(const mem_heap_t *h);
+
+/**
+ * @brief Empties the default heap and gives its pages back to the system.
+ *
+ * Like mem_reset_brk, but afterwards no page of the heap is resident.
+ */
+void mem_release_heap(void);
+
+/**
+ * @brief Measures how much of the dense heap occupies memory.
+ *
+ * Counts whole pages from the start of the heap to the break.  Both
+ * counts are zero in sparse emulation.
+ *
+ * @param[out] resident Bytes in pages that are resident
+ * @param[out] written  Bytes in pages that have been written
+ * @return False if written pages could not be told apart from resident
+ *         ones, in which case written equals resident
+ */
+bool mem_heap_residency(size_t *resident, size_t *written);
 
 /**
  * @brief Returns the system page size.
@@ -113,6 +193,24 @@ void *mem_memset(void *dst, int c, size_t n);
  */
 void hprobe(void *ptr, int offset, size_t count);
 
+/**
+ * @brief Called with each emulated access to a heap, if set.
+ * @param[in] addr  Simulated address of the first byte accessed
+ * @param[in] len   Number of bytes accessed
+ * @param[in] write Whether the access is a store
+ */
+typedef void (*mem_access_fn)(const void *addr, size_t len, bool write);
+
+/**
+ * @brief Reports every emulated heap access to fn, or stops if NULL.
+ *
+ * Loads and stores are reported one at a time, and mem_memcpy and
+ * mem_memset a span at a time.  Only sparse emulation sees the accesses.
+ *
+ * @param[in] fn The function to call, or NULL
+ */
+void mem_set_profiler(mem_access_fn fn);
+
 /**
  * @brief Set whether the driver should check for UB
  */
@@ -0,0 +1,58 @@
+/**
+ * @file mm-lock.c
+ * @brief One lock around mm.c, so mm-mt.so may be called from threads.
+ *
+ * mm.c keeps a single heap with no locking of its own.  For mm-mt.so, its
+ * malloc, free, realloc and calloc are renamed unlocked_*, and the
+ * functions here call them holding one mutex.  The library constructor
+ * sets the heap up before any thread can race to do it.
+ *
+ * mm_thread_safe marks the library as safe to call from several threads;
+ * mdriver -L will not load a library without it.
+ */
+#include <pthread.h>
+#include <stddef.h>
+
+void *unlocked_malloc(size_t size);
+void unlocked_free(void *ptr);
+void *unlocked_realloc(void *ptr, size_t size);
+void *unlocked_calloc(size_t nmemb, size_t size);
+
+const int mm_thread_safe = 1;
+
+/* Statically initialized, as the loader may allocate before constructors */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((constructor)) static void lock_init(void) {
+    /* malloc(0) sets up the heap, if no request has yet, and fails */
+    pthread_mutex_lock(&lock);
+    unlocked_malloc(0);
+    pthread_mutex_unlock(&lock);
+}
+
+void *malloc(size_t size) {
+    pthread_mutex_lock(&lock);
+    void *p = unlocked_malloc(size);
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+void free(void *ptr) {
+    pthread_mutex_lock(&lock);
+    unlocked_free(ptr);
+    pthread_mutex_unlock(&lock);
+}
+
+void *realloc(void *ptr, size_t size) {
+    pthread_mutex_lock(&lock);
+    void *p = unlocked_realloc(ptr, size);
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    pthread_mutex_lock(&lock);
+    void *p = unlocked_calloc(nmemb, size);
+    pthread_mutex_unlock(&lock);
+    return p;
+}
@@ -0,0 +1,481 @@
+/*
+ * mm-record.c - Records the allocation requests of a program
+ *
+ * Build mm-record.so and run any program with it preloaded:
+ *
+ *     unix> MM_RECORD_FILE=prog.bin LD_PRELOAD=./mm-record.so prog
+ *     unix> ./record2rep -o prog.rep prog.bin
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are passed on
+ * to the next definition, normally libc's, and each request that
+ * succeeds is logged.  Each thread logs into a buffer of its own,
+ * without locks; a full buffer is pushed onto a lock-free stack, and a
+ * background thread writes the buffers on the stack to the file.  The
+ * buffers left at exit are written by a destructor.  A buffer belongs to
+ * whoever last swapped it out of its thread's slot, so the destructor
+ * never writes a buffer that its thread is still filling.
+ *
+ * The recording goes to MM_RECORD_FILE, or mmrecord.<pid>.bin by default.
+ * Each %p in the name is replaced by the pid, which keeps the programs a
+ * recorded program runs from writing over its recording.
+ *
+ * Requests are ordered by a shared counter.  A free takes its number
+ * before the block is freed, and an allocation after the block is
+ * returned, so a block freed by one thread and reused by another is
+ * always freed first in the order.  A realloc takes both: its old block
+ * is logged as released with a number taken before the call, and the
+ * result with one taken after it.
+ *
+ * Requests made before the library is initialized, by the recorder
+ * itself, or by a child after fork are not logged.  Nor are requests
+ * made by other threads while the process exits.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "mm-record.h"
+
+#define ARENA_SIZE 65536 /* memory for dlsym before libc is found */
+#define ARENA_ALIGN 16
+
+/* Requests logged by one thread, waiting to be written */
+typedef struct recbuf
+{
+    struct recbuf *next; /* next buffer on the full stack */
+    size_t count;        /* records in use */
+    rec_t recs[REC_BUF_RECORDS];
+} recbuf_t;
+
+typedef struct recthread
+{
+    struct recthread *next; /* next thread that has logged a request */
+    recbuf_t *buf;          /* buffer to fill, NULL if none or in use */
+    uint32_t tid;
+} recthread_t;
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+static TLS recthread_t *self; /* this thread's log */
+static TLS bool busy;         /* in the recorder, so don't log requests */
+
+/* The allocator being recorded */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static bool resolving;
+
+/* Handed out while dlsym looks up the real allocator; never freed */
+static unsigned char arena[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static size_t arena_used;
+
+static bool recording;    /* log requests */
+static bool stopping;     /* tells the writer to finish */
+static int out_fd = -1;   /* the recording, or -1 */
+static uint64_t start_ns; /* time the recording started */
+static uint64_t next_seq;
+static uint32_t next_tid;
+static recbuf_t *full_bufs;      /* stack of buffers to write */
+static recthread_t *all_threads; /* every thread that has logged */
+static pthread_key_t exit_key;
+static pthread_t writer;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void resolve(void)
+{
+    if (resolving)
+        return;
+    resolving = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = false;
+}
+
+static void *arena_alloc(size_t size)
+{
+    size_t start = (arena_used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (size > ARENA_SIZE - start)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena_used = start + size;
+    return arena + start;
+}
+
+static bool in_arena(const void *p)
+{
+    return (const unsigned char *)p >= arena &&
+           (const unsigned char *)p < arena + ARENA_SIZE;
+}
+
+/* Whether to log a request made now by this thread */
+static bool logging(void)
+{
+    return !busy && __atomic_load_n(&recording, __ATOMIC_RELAXED);
+}
+
+static uint64_t take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+static void *map(size_t bytes)
+{
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void push_full(recbuf_t *b)
+{
+    b->next = __atomic_load_n(&full_bufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&full_bufs, &b->next, b, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static recthread_t *new_thread(void)
+{
+    recthread_t *t = map(sizeof(recthread_t));
+
+    if (t == NULL)
+        return NULL;
+    t->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    t->next = __atomic_load_n(&all_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&all_threads, &t->next, t, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(exit_key, t);
+    return t;
+}
+
+static void log_op(uint64_t seq, rec_type_t type, const void *ptr,
+                   const void *old, size_t size)
+{
+    recthread_t *t;
+    recbuf_t *b;
+    rec_t *r;
+
+    busy = true;
+    if (self == NULL)
+        self = new_thread();
+    if ((t = self) == NULL)
+    {
+        busy = false;
+        return;
+    }
+    /* Take the buffer, so that record_fini can't write it meanwhile */
+    if ((b = __atomic_exchange_n(&t->buf, NULL, __ATOMIC_ACQUIRE)) == NULL &&
+        (b = map(sizeof(recbuf_t))) == NULL)
+    {
+        busy = false;
+        return;
+    }
+    r = &b->recs[b->count];
+    r->seq = seq;
+    r->ns = now_ns() - start_ns;
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+    r->size = size;
+    r->tid = t->tid;
+    r->type = type;
+    if (++b->count == REC_BUF_RECORDS)
+        push_full(b);
+    else
+        __atomic_store_n(&t->buf, b, __ATOMIC_RELEASE);
+    busy = false;
+}
+
+/* Hand on the buffer of a thread that is exiting */
+static void thread_exit(void *arg)
+{
+    recthread_t *t = arg;
+    recbuf_t *b;
+
+    busy = true;
+    if ((b = __atomic_exchange_n(&t->buf, NULL, __ATOMIC_ACQUIRE)) != NULL)
+        push_full(b);
+    busy = false;
+}
+
+static void write_all(const void *p, size_t bytes)
+{
+    const char *s = p;
+    ssize_t n;
+
+    while (bytes > 0)
+    {
+        if ((n = write(out_fd, s, bytes)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("mm-record: write");
+            return;
+        }
+        s += n;
+        bytes -= (size_t)n;
+    }
+}
+
+/* Write and free the buffers on the full stack */
+static bool write_full(void)
+{
+    recbuf_t *b = __atomic_exchange_n(&full_bufs, NULL, __ATOMIC_ACQUIRE);
+    recbuf_t *next;
+
+    if (b == NULL)
+        return false;
+    for (; b != NULL; b = next)
+    {
+        next = b->next;
+        write_all(b->recs, b->count * sizeof(rec_t));
+        munmap(b, sizeof(recbuf_t));
+    }
+    return true;
+}
+
+static void *writer_main(void *arg)
+{
+    struct timespec poll = {0, REC_POLL_NS};
+
+    busy = true;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    {
+        if (!write_full())
+            nanosleep(&poll, NULL);
+    }
+    return NULL;
+}
+
+/* A child has no writer, and its buffers are copies of the parent's */
+static void after_fork_child(void)
+{
+    __atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+    if (out_fd >= 0)
+        close(out_fd);
+    out_fd = -1;
+}
+
+/* Copy the file name pattern to path, replacing each %p by the pid */
+static void expand_name(char *path, size_t len, const char *pattern)
+{
+    size_t n = 0;
+
+    for (; *pattern != '\0' && n + 1 < len; pattern++)
+    {
+        if (pattern[0] == '%' && pattern[1] == 'p')
+        {
+            n += (size_t)snprintf(path + n, len - n, "%d", (int)getpid());
+            pattern++;
+        }
+        else
+            path[n++] = *pattern;
+    }
+    path[n < len ? n : len - 1] = '\0';
+}
+
+__attribute__((constructor)) static void record_init(void)
+{
+    char path[PATH_MAX];
+    const char *pattern = getenv("MM_RECORD_FILE");
+    rec_header_t hdr;
+
+    busy = true;
+    resolve();
+    if (pattern == NULL || *pattern == '\0')
+        pattern = "mmrecord.%p.bin";
+    expand_name(path, sizeof(path), pattern);
+    if ((out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        fprintf(stderr, "mm-record: could not open %s: %s\n", path,
+                strerror(errno));
+        busy = false;
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+    hdr.version = REC_VERSION;
+    hdr.rec_size = sizeof(rec_t);
+    write_all(&hdr, sizeof(hdr));
+
+    if (pthread_key_create(&exit_key, thread_exit) != 0 ||
+        pthread_create(&writer, NULL, writer_main, NULL) != 0)
+    {
+        fprintf(stderr, "mm-record: could not start the writer\n");
+        close(out_fd);
+        out_fd = -1;
+        busy = false;
+        return;
+    }
+    pthread_atfork(NULL, NULL, after_fork_child);
+    start_ns = now_ns();
+    __atomic_store_n(&recording, true, __ATOMIC_RELEASE);
+    busy = false;
+}
+
+__attribute__((destructor)) static void record_fini(void)
+{
+    recthread_t *t;
+    recbuf_t *b;
+
+    if (out_fd < 0)
+        return;
+    busy = true;
+    __atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    for (t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t != NULL;
+         t = t->next)
+    {
+        /* A thread still logging holds its buffer; that one is lost */
+        b = __atomic_exchange_n(&t->buf, NULL, __ATOMIC_ACQUIRE);
+        if (b != NULL && b->count > 0)
+            push_full(b);
+    }
+    write_full();
+    close(out_fd);
+    out_fd = -1;
+}
+
+/*
+ * The interposed functions
+ */
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL)
+        resolve();
+    if (real_malloc == NULL)
+        return arena_alloc(size);
+    if ((p = real_malloc(size)) != NULL && logging())
+        log_op(take_seq(), REC_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t m)
+{
+    void *p;
+
+    if (real_calloc == NULL)
+        resolve();
+    if (real_calloc == NULL)
+        return m != 0 && n > SIZE_MAX / m ? NULL : arena_alloc(n * m);
+    if ((p = real_calloc(n, m)) != NULL && logging())
+        log_op(take_seq(), REC_CALLOC, p, NULL, n * m);
+    return p;
+}
+
+void *realloc(void *old, size_t size)
+{
+    uint64_t seq;
+    void *p;
+
+    if (in_arena(old))
+    {
+        size_t avail = (size_t)(arena + ARENA_SIZE - (unsigned char *)old);
+        if ((p = malloc(size)) != NULL)
+            memcpy(p, old, size < avail ? size : avail);
+        return p;
+    }
+    if (real_realloc == NULL)
+        resolve();
+    if (old == NULL || !logging())
+    {
+        p = real_realloc(old, size);
+        if (p != NULL && logging())
+            log_op(take_seq(), REC_REALLOC, p, NULL, size);
+        return p;
+    }
+    /* old may be reused by another thread as soon as the call releases it */
+    seq = take_seq();
+    p = real_realloc(old, size);
+    if (p != NULL)
+    {
+        log_op(seq, REC_RELEASE, old, NULL, 0);
+        log_op(take_seq(), REC_REALLOC, p, old, size);
+    }
+    else if (size == 0)
+        log_op(seq, REC_FREE, old, NULL, 0);
+    /* A failed realloc leaves the old block as it was */
+    return p;
+}
+
+void free(void *p)
+{
+    uint64_t seq;
+
+    if (p == NULL || in_arena(p))
+        return;
+    if (!logging())
+    {
+        real_free(p);
+        return;
+    }
+    seq = take_seq();
+    real_free(p);
+    log_op(seq, REC_FREE, p, NULL, 0);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    int err;
+
+    if (real_posix_memalign == NULL)
+        resolve();
+    if ((err = real_posix_memalign(pp, align, size)) == 0 && logging())
+        log_op(take_seq(), REC_MALLOC, *pp, NULL, size);
+    return err;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_aligned_alloc == NULL)
+        resolve();
+    if ((p = real_aligned_alloc(align, size)) != NULL && logging())
+        log_op(take_seq(), REC_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_memalign == NULL)
+        resolve();
+    if ((p = real_memalign(align, size)) != NULL && logging())
+        log_op(take_seq(), REC_MALLOC, p, NULL, size);
+    return p;
+}
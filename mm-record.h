@@ -0,0 +1,40 @@
+/*
+ * Binary trace format written by the recorder, mm-record.so
+ *
+ * A recording is a rec_header_t followed by rec_t records.  Each thread
+ * logs into its own buffer, so the records of different threads are
+ * interleaved in the file in no particular order; seq gives the order
+ * in which the requests were made.  record2rep turns a recording into a
+ * .rep trace.
+ */
+#include <stdint.h>
+
+#define REC_MAGIC "MMREC\r\n\032"
+#define REC_VERSION 2
+
+typedef enum
+{
+    REC_MALLOC,  /* ptr = malloc(size), or an aligned allocation */
+    REC_CALLOC,  /* ptr = calloc(n, m), with size = n * m */
+    REC_REALLOC, /* ptr = realloc(old, size), after a REC_RELEASE of old */
+    REC_FREE,    /* free(ptr), or a realloc to 0 bytes that freed ptr */
+    REC_RELEASE  /* realloc is about to give up ptr, numbered before it */
+} rec_type_t;
+
+typedef struct
+{
+    char magic[8];     /* REC_MAGIC */
+    uint32_t version;  /* REC_VERSION */
+    uint32_t rec_size; /* sizeof(rec_t) */
+} rec_header_t;
+
+typedef struct
+{
+    uint64_t seq;  /* position in the order of all requests */
+    uint64_t ns;   /* time since the recording started */
+    uint64_t ptr;  /* block returned, freed or released */
+    uint64_t old;  /* block passed to realloc, or 0 */
+    uint64_t size; /* bytes requested */
+    uint32_t tid;  /* thread, numbered from 0 in order of first request */
+    uint32_t type; /* a rec_type_t */
+} rec_t;
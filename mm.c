@@ -125,6 +125,8 @@ typedef struct block {
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
+/** @brief First block of the newest heap region, heap_start until a second */
+static block_t *region_start = NULL;
 // static block_t *exp_start = NULL;
 static const size_t seg_size = 14;
 static block_t *seg_list[seg_size];
@@ -389,6 +391,22 @@ static block_t *find_prev(block_t *block) {
 }
 
 
+/**
+ * @brief Finds the first block of the region before a region.
+ *
+ * Each region after the first starts with a word holding the first block of
+ * the region before it, two words ahead of its prologue.
+ *
+ * @param[in] first The first block of a region
+ * @return The first block of the previous region, or NULL for the first one
+ */
+static block_t *prev_region(block_t *first) {
+    if (first == heap_start) {
+        return NULL;
+    }
+    return (block_t *)*(&(first->header) - 3);
+}
+
 static void print_heap(int line) {
     block_t *block;
     int a;
@@ -396,15 +414,17 @@ static void print_heap(int line) {
     dbg_printf("\n*************************\n");
     dbg_printf("\n HEAP PRINT:\n");
     dbg_printf("=======================\n");
-    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
-        dbg_printf("=======================\n");
-        dbg_printf("Address: %p : \n", block);
-        a = get_alloc(block) ? 1 : 0;
-        dbg_printf("Allocation status: %d\n", a);
-        dbg_printf("Size: %lu\n", get_size(block));
-        b = block->header & prev_alloc_mask;
-        dbg_printf("Prev_Alloc status: %d\n", b);
-
+    for (block_t *first = region_start; first != NULL;
+         first = prev_region(first)) {
+        for (block = first; get_size(block) > 0; block = find_next(block)) {
+            dbg_printf("=======================\n");
+            dbg_printf("Address: %p : \n", block);
+            a = get_alloc(block) ? 1 : 0;
+            dbg_printf("Allocation status: %d\n", a);
+            dbg_printf("Size: %lu\n", get_size(block));
+            b = block->header & prev_alloc_mask;
+            dbg_printf("Prev_Alloc status: %d\n", b);
+        }
     }
     dbg_printf("=======================\n");
 
@@ -616,6 +636,7 @@ static block_t *coalesce_block(block_t *block) {
  */
 static block_t *extend_heap(size_t size) {
     void *bp;
+    char *old_end = (char *)mem_heap_hi() + 1;
 
     bool prev_alloc = *((word_t *)((char*)mem_heap_hi() - 0x7)) & prev_alloc_mask;
 
@@ -624,6 +645,20 @@ static block_t *extend_heap(size_t size) {
     if ((bp = mem_sbrk(size)) == (void *)-1) {
         return NULL;
     }
+    // The heap may continue in a new region, not after the old epilogue.
+    // Start the region with a link to the previous region, for walking the
+    // heap, and its own prologue, and take room for an epilogue
+    if ((char *)bp != old_end) {
+        if (mem_sbrk(2 * dsize) == (void *)-1) {
+            return NULL;
+        }
+        word_t *start = (word_t *)bp;
+        start[0] = (word_t)region_start; // Link to the previous region
+        start[2] = pack(0, true, true);  // Region prologue (block footer)
+        bp = &start[4];
+        prev_alloc = true;
+        region_start = payload_to_header(bp);
+    }
     // Initialize free block header/footer
     block_t *block = payload_to_header(bp);
     write_block(block, size, false, prev_alloc);
@@ -972,16 +1007,20 @@ bool mm_checkheap(int line) {
     if (!checkPrologue())
         return false;
 
-    for (tmp = firstBlock; tmp != (mem_heap_hi() - 7); tmp = find_next(tmp)) {
+    // Each region ends with its own epilogue
+    for (firstBlock = region_start; firstBlock != NULL;
+         firstBlock = prev_region(firstBlock)) {
+        for (tmp = firstBlock; get_size(tmp) > 0; tmp = find_next(tmp)) {
 
-        if (!checkAlignment(tmp))
-            return false;
-        if (!checkAddresses(tmp))
-            return false;
-        if (!checkHeaderFooter(tmp))
-            return false;
-        if (!checkCoalescing(tmp))
-            return false;
+            if (!checkAlignment(tmp))
+                return false;
+            if (!checkAddresses(tmp))
+                return false;
+            if (!checkHeaderFooter(tmp))
+                return false;
+            if (!checkCoalescing(tmp))
+                return false;
+        }
     }
 
     if (!checkEpilogue())
@@ -991,6 +1030,93 @@ bool mm_checkheap(int line) {
     return true;
 }
 
+/**
+ * @brief Counts the blocks on each segregated free list.
+ *
+ * Each list is circular, so the walk stops on returning to the root.
+ *
+ * @param[out] lengths length of seg_list[i] for each list i
+ * @param[in] max number of entries in lengths
+ * @return the number of lists counted
+ */
+int mm_free_list_lengths(size_t *lengths, int max) {
+    int i;
+    for (i = 0; i < (int)seg_size && i < max; i++) {
+        size_t n = 0;
+        block_t *block = seg_list[i];
+        if (block != NULL) {
+            do {
+                n++;
+                block = block->fb.explicit_next;
+            } while (block != seg_list[i]);
+        }
+        lengths[i] = n;
+    }
+    return i;
+}
+
+/**
+ * @brief Totals the sizes of the blocks on each segregated free list.
+ *
+ * @param[out] bytes bytes in the blocks of seg_list[i] for each list i
+ * @param[out] largest size of the largest free block
+ * @param[in] max number of entries in bytes
+ * @return the number of lists totalled
+ */
+int mm_free_list_bytes(size_t *bytes, size_t *largest, int max) {
+    int i;
+    *largest = 0;
+    for (i = 0; i < (int)seg_size && i < max; i++) {
+        size_t n = 0;
+        block_t *block = seg_list[i];
+        if (block != NULL) {
+            do {
+                size_t size = get_size(block);
+                n += size;
+                if (size > *largest)
+                    *largest = size;
+                block = block->fb.explicit_next;
+            } while (block != seg_list[i]);
+        }
+        bytes[i] = n;
+    }
+    return i;
+}
+
+/**
+ * @brief Calls visit on each block of the region starting with first, after
+ * those of the regions before it.
+ */
+static void walk_region(block_t *first,
+                        void (*visit)(void *payload, size_t size,
+                                      size_t usable, bool alloc, void *arg),
+                        void *arg) {
+    block_t *block;
+    block_t *prev = prev_region(first);
+    if (prev != NULL)
+        walk_region(prev, visit, arg);
+    for (block = first; get_size(block) > 0; block = find_next(block)) {
+        visit(header_to_payload(block), get_size(block),
+              get_payload_size(block), get_alloc(block), arg);
+    }
+}
+
+/**
+ * @brief Calls visit on each block from heap_start to the epilogue, going
+ * on through each region the heap has moved to.
+ *
+ * @param[in] visit called with the payload, size, payload size and
+ *            allocation status of each block
+ * @param[in] arg passed on to visit
+ */
+void mm_walk_heap(void (*visit)(void *payload, size_t size, size_t usable,
+                                bool alloc, void *arg),
+                  void *arg) {
+    if (heap_start == NULL)
+        return;
+    walk_region(region_start, visit, arg);
+}
+
 /**
  * @brief
  *
@@ -1016,6 +1142,7 @@ bool mm_init(void) {
 
     // Heap starts with first "block header", currently the epilogue
     heap_start = (block_t *)&(start[1]);
+    region_start = heap_start;
     for (size_t i = 0; i < seg_size; i++) {
         seg_list[i] = NULL;
     }
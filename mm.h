@@ -74,3 +74,48 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+/**
+ * @brief  Count the blocks on each of the allocator's free lists.
+ *
+ * Optional: an allocator that does not keep free lists need not define
+ * it, in which case it is NULL.  The driver uses it to report free-list
+ * growth in soak mode.
+ *
+ * @param[out] lengths  Receives the length of each free list.
+ * @param[in] max  The number of entries `lengths` has room for.
+ *
+ * @return  The number of entries filled in.
+ */
+extern int mm_free_list_lengths(size_t *lengths, int max)
+    __attribute__((weak));
+
+/**
+ * @brief  Total the free bytes on each of the allocator's free lists.
+ *
+ * Optional, like mm_free_list_lengths.  The driver uses it for the heap
+ * timeline.
+ *
+ * @param[out] bytes  Receives the bytes in the blocks of each free list.
+ * @param[out] largest  Receives the size of the largest free block.
+ * @param[in] max  The number of entries `bytes` has room for.
+ *
+ * @return  The number of entries filled in.
+ */
+extern int mm_free_list_bytes(size_t *bytes, size_t *largest, int max)
+    __attribute__((weak));
+
+/**
+ * @brief  Visit every block in the heap, in address order.
+ *
+ * Optional, like mm_free_list_lengths.  The driver uses it to break the
+ * heap down into payload, overhead and free space.
+ *
+ * @param[in] visit  Called with each block's payload address, the size of
+ *                   the block, the bytes of it that can hold payload, and
+ *                   whether it is allocated.
+ * @param[in] arg  Passed on to `visit`.
+ */
+extern void mm_walk_heap(void (*visit)(void *payload, size_t size,
+                                       size_t usable, bool alloc, void *arg),
+                         void *arg) __attribute__((weak));
@@ -0,0 +1,413 @@
+/*
+ * record2rep.c - Turns a recording made by mm-record.so into a trace
+ *
+ * The requests are sorted into the order they were made and each block
+ * is given an id, a new one for every allocation, so the output is a
+ * version 2 .rep trace that mdriver can read.  The recording may not
+ * be a closed trace, so it is normalized:
+ *
+ *  - A realloc is logged as two records: the release of its old block,
+ *    numbered before the call, and its result, numbered after it.  The
+ *    block leaves the address map at the release, since another thread
+ *    may be given the address at once, and is resized at the result.
+ *  - Frees of blocks allocated before recording began are dropped, and
+ *    so are reallocs of such blocks, which become allocations.
+ *  - An allocation of an address that is still live ends the block that
+ *    was there, with a free made just before it.  This happens when a
+ *    free was not logged.
+ *  - Requests for 0 bytes are made for 1 byte, since malloc(0) returns
+ *    a block.
+ *  - Thread ids are renumbered from 0, and times made relative to the
+ *    first request.
+ *
+ * Blocks that are still live at the end are left allocated.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "mm-record.h"
+
+#define MAP_MIN_SLOTS 1024 /* initial size of the block map, a power of 2 */
+
+/* Map from live block addresses to their ids, with linear probing */
+typedef struct
+{
+    uint64_t *keys; /* address, or 0 for an empty slot */
+    int *ids;
+    size_t slots; /* a power of 2 */
+    size_t count;
+} blockmap_t;
+
+/* One request of the output trace */
+typedef struct
+{
+    char type; /* 'a', 'r' or 'f' */
+    int id;
+    uint64_t size;
+    int tid;
+    uint64_t ns;
+} repop_t;
+
+static int verbose = 0;
+
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void unix_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+
+static void *must_alloc(size_t bytes)
+{
+    void *p = calloc(1, bytes);
+
+    if (p == NULL && bytes > 0)
+        unix_error("Could not allocate %zu bytes", bytes);
+    return p;
+}
+
+static void *must_grow(void *p, size_t bytes)
+{
+    if ((p = realloc(p, bytes)) == NULL)
+        unix_error("Could not allocate %zu bytes", bytes);
+    return p;
+}
+
+static size_t map_slot(const blockmap_t *m, uint64_t key)
+{
+    size_t i = (size_t)(key * 0x9E3779B97F4A7C15UL) & (m->slots - 1);
+
+    while (m->keys[i] != 0 && m->keys[i] != key)
+        i = (i + 1) & (m->slots - 1);
+    return i;
+}
+
+static void map_init(blockmap_t *m, size_t slots)
+{
+    m->slots = slots;
+    m->count = 0;
+    m->keys = must_alloc(slots * sizeof(uint64_t));
+    m->ids = must_alloc(slots * sizeof(int));
+}
+
+/* The id of the block at key, or -1 */
+static int map_find(const blockmap_t *m, uint64_t key)
+{
+    size_t i = map_slot(m, key);
+
+    return m->keys[i] == key ? m->ids[i] : -1;
+}
+
+static void map_add(blockmap_t *m, uint64_t key, int id)
+{
+    size_t i = map_slot(m, key);
+
+    if (m->keys[i] == 0)
+        m->count++;
+    m->keys[i] = key;
+    m->ids[i] = id;
+    if (m->count * 2 > m->slots)
+    {
+        blockmap_t old = *m;
+
+        map_init(m, old.slots * 2);
+        for (i = 0; i < old.slots; i++)
+        {
+            if (old.keys[i] != 0)
+                map_add(m, old.keys[i], old.ids[i]);
+        }
+        free(old.keys);
+        free(old.ids);
+    }
+}
+
+/* Remove key, moving back the entries that probed past its slot */
+static void map_remove(blockmap_t *m, uint64_t key)
+{
+    size_t i = map_slot(m, key), j, home;
+
+    if (m->keys[i] == 0)
+        return;
+    m->count--;
+    for (j = (i + 1) & (m->slots - 1); m->keys[j] != 0;
+         j = (j + 1) & (m->slots - 1))
+    {
+        home = (size_t)(m->keys[j] * 0x9E3779B97F4A7C15UL) & (m->slots - 1);
+        /* The entry at j may move to i if i lies between home and j */
+        if (((j - home) & (m->slots - 1)) >= ((j - i) & (m->slots - 1)))
+        {
+            m->keys[i] = m->keys[j];
+            m->ids[i] = m->ids[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const rec_t *)a)->seq, y = ((const rec_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/* Read every record of a recording */
+static rec_t *read_recording(const char *path, size_t *num)
+{
+    FILE *fp;
+    rec_header_t hdr;
+    rec_t *recs = NULL;
+    size_t cap = 0, bytes = 0, got;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        unix_error("Could not open %s", path);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0)
+        app_error("%s: not a recording", path);
+    if (hdr.version != REC_VERSION || hdr.rec_size != sizeof(rec_t))
+        app_error("%s: unknown recording version %" PRIu32, path,
+                  hdr.version);
+    /* Read bytes, so that a partial record at the end can be told */
+    for (;;)
+    {
+        if (bytes == cap * sizeof(rec_t))
+        {
+            cap = cap ? 2 * cap : 4096;
+            recs = must_grow(recs, cap * sizeof(rec_t));
+        }
+        if ((got = fread((char *)recs + bytes, 1,
+                         cap * sizeof(rec_t) - bytes, fp)) == 0)
+            break;
+        bytes += got;
+    }
+    if (ferror(fp))
+        unix_error("Could not read %s", path);
+    if (bytes % sizeof(rec_t) != 0)
+        app_error("%s: truncated record", path);
+    fclose(fp);
+    *num = bytes / sizeof(rec_t);
+    return recs;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hv] [-w <weight>] [-o <file>] <recording>\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-o <file>  Write the trace to <file> (default "
+                    "stdout).\n");
+    fprintf(stderr, "\t-v         Report what was normalized.\n");
+    fprintf(stderr, "\t-w <n>     Weight of the trace (default 1).\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *outname = NULL;
+    FILE *out = stdout;
+    int weight = 1;
+    rec_t *recs;
+    size_t num_recs, i;
+    repop_t *ops;
+    int num_ops = 0, num_ids = 0, num_threads = 0, j;
+    uint64_t *sizes = NULL; /* current size of each block, by id */
+    int *tids = NULL;       /* output thread of each recorded thread */
+    int *released = NULL;   /* block each recorded thread is reallocating */
+    uint32_t max_tid = 0;
+    uint64_t live = 0, peak = 0, t0;
+    size_t dropped = 0, implicit = 0;
+    blockmap_t map;
+    int c;
+
+    while ((c = getopt(argc, argv, "ho:vw:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'o':
+            outname = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            if (weight < 0 || weight > 3)
+                app_error("Weight must be in {0, 1, 2, 3}");
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    recs = read_recording(argv[optind], &num_recs);
+    qsort(recs, num_recs, sizeof(rec_t), cmp_seq);
+    for (i = 0; i < num_recs; i++)
+        max_tid = recs[i].tid > max_tid ? recs[i].tid : max_tid;
+    tids = must_alloc(((size_t)max_tid + 1) * sizeof(int));
+    memset(tids, -1, ((size_t)max_tid + 1) * sizeof(int));
+    released = must_alloc(((size_t)max_tid + 1) * sizeof(int));
+    memset(released, -1, ((size_t)max_tid + 1) * sizeof(int));
+
+    /* A request may add a free before it, so allow two ops per record */
+    ops = must_alloc(2 * num_recs * sizeof(repop_t));
+    map_init(&map, MAP_MIN_SLOTS);
+    t0 = num_recs > 0 ? recs[0].ns : 0;
+
+    for (i = 0; i < num_recs; i++)
+    {
+        const rec_t *r = &recs[i];
+        uint64_t size = r->size > 0 ? r->size : 1;
+        int id, prev;
+        repop_t op;
+
+        if (tids[r->tid] < 0)
+        {
+            if (num_threads == MAX_TRACE_THREADS)
+                app_error("More than %d threads", MAX_TRACE_THREADS);
+            tids[r->tid] = num_threads++;
+        }
+        op.tid = tids[r->tid];
+        op.ns = r->ns > t0 ? r->ns - t0 : 0;
+
+        id = -1;
+        if (r->type == REC_FREE || r->type == REC_RELEASE)
+        {
+            if ((id = map_find(&map, r->ptr)) < 0)
+                dropped++;
+            else
+                map_remove(&map, r->ptr);
+        }
+        if (r->type == REC_RELEASE)
+        {
+            /* Held until the thread logs the result of its realloc */
+            released[r->tid] = id;
+            continue;
+        }
+        if (r->type == REC_REALLOC && r->old != 0)
+        {
+            id = released[r->tid];
+            released[r->tid] = -1;
+        }
+        if (r->type == REC_FREE)
+        {
+            if (id < 0)
+                continue;
+            live -= sizes[id];
+            op.type = 'f';
+            op.id = id;
+            op.size = 0;
+            ops[num_ops++] = op;
+            continue;
+        }
+
+        /* End any block still recorded at the new address */
+        if ((prev = map_find(&map, r->ptr)) >= 0)
+        {
+            map_remove(&map, r->ptr);
+            live -= sizes[prev];
+            op.type = 'f';
+            op.id = prev;
+            op.size = 0;
+            ops[num_ops++] = op;
+            implicit++;
+        }
+        if (id >= 0)
+        {
+            live -= sizes[id];
+            op.type = 'r';
+        }
+        else
+        {
+            id = num_ids++;
+            sizes = must_grow(sizes, (size_t)num_ids * sizeof(uint64_t));
+            op.type = 'a';
+        }
+        map_add(&map, r->ptr, id);
+        sizes[id] = size;
+        live += size;
+        peak = live > peak ? live : peak;
+        op.id = id;
+        op.size = size;
+        ops[num_ops++] = op;
+    }
+
+    if (outname != NULL && (out = fopen(outname, "w")) == NULL)
+        unix_error("Could not open %s", outname);
+    fprintf(out, "v2 %d\n%d\n%d\n%d\n%" PRIu64 "\n",
+            num_threads > 0 ? num_threads : 1, weight, num_ids, num_ops,
+            peak);
+    for (j = 0; j < num_ops; j++)
+    {
+        const repop_t *op = &ops[j];
+
+        if (op->type == 'f')
+            fprintf(out, "f %d %d %" PRIu64 "\n", op->id, op->tid, op->ns);
+        else
+            fprintf(out, "%c %d %" PRIu64 " %d %" PRIu64 "\n", op->type,
+                    op->id, op->size, op->tid, op->ns);
+    }
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0))
+        unix_error("Could not write %s", outname ? outname : "stdout");
+
+    if (verbose)
+    {
+        fprintf(stderr, "%zu requests, %d threads: %d ops on %d blocks, "
+                        "peak %" PRIu64 " bytes\n",
+                num_recs, num_threads, num_ops, num_ids, peak);
+        fprintf(stderr, "%zu requests on unknown blocks, %zu frees "
+                        "added\n",
+                dropped, implicit);
+    }
+    free(recs);
+    free(ops);
+    free(sizes);
+    free(tids);
+    free(released);
+    free(map.keys);
+    free(map.ids);
+    return 0;
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * unix_error - Report the error and its errno, and exit
+ */
+static void unix_error(const char *fmt, ...)
+{
+    int err = errno;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", strerror(err));
+    exit(1);
+}